@@ -0,0 +1,187 @@
+// Benchmarks LazyMatrixMarch on synthetic sequence pairs.
+// Usage: lmm-bench [sizes...], defaults to 100 to 60000.
+// Since sequences are up to 60K elements, the paged storage is used.
+
+#include <lmm.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace vil;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Sequences {
+	std::vector<u32> a;
+	std::vector<u32> b;
+};
+
+// Element values are drawn from a large alphabet, so unrelated elements
+// practically never match.
+constexpr u32 alphabetSize = 1u << 30;
+
+std::vector<u32> randomSequence(std::mt19937& rng, u32 size) {
+	std::vector<u32> ret(size);
+	for(auto& val : ret) {
+		val = rng() % alphabetSize;
+	}
+
+	return ret;
+}
+
+Sequences identical(std::mt19937& rng, u32 size) {
+	auto a = randomSequence(rng, size);
+	return {a, a};
+}
+
+// b starts with a tenth of new elements, followed by a without its end.
+Sequences shifted(std::mt19937& rng, u32 size) {
+	auto a = randomSequence(rng, size);
+	auto shift = std::max(size / 10, 1u);
+	auto b = randomSequence(rng, shift);
+	b.insert(b.end(), a.begin(), a.end() - shift);
+	return {std::move(a), std::move(b)};
+}
+
+// b is a with 5% of the elements removed and 5% random ones inserted.
+Sequences indels(std::mt19937& rng, u32 size) {
+	auto a = randomSequence(rng, size);
+	std::vector<u32> b;
+	b.reserve(size);
+	for(auto val : a) {
+		auto r = rng() % 20;
+		if(r == 0u) {
+			continue;
+		} else if(r == 1u) {
+			b.push_back(rng() % alphabetSize);
+		}
+
+		b.push_back(val);
+	}
+
+	if(b.empty()) {
+		b.push_back(a[0]);
+	}
+
+	return {std::move(a), std::move(b)};
+}
+
+// b is a split into 8 blocks, with the second and the second last one
+// swapped.
+Sequences blockMoves(std::mt19937& rng, u32 size) {
+	auto a = randomSequence(rng, size);
+	auto b = a;
+	auto blockSize = size / 8;
+	if(blockSize > 0u) {
+		std::swap_ranges(b.begin() + blockSize, b.begin() + 2 * blockSize,
+			b.begin() + 6 * blockSize);
+	}
+
+	return {std::move(a), std::move(b)};
+}
+
+Sequences dissimilar(std::mt19937& rng, u32 size) {
+	return {randomSequence(rng, size), randomSequence(rng, size)};
+}
+
+// Small alphabet and b is a with noise added to every element.
+// Elements match partially, depending on their distance.
+Sequences fuzzy(std::mt19937& rng, u32 size) {
+	std::vector<u32> a(size);
+	std::vector<u32> b(size);
+	for(auto i = 0u; i < size; ++i) {
+		a[i] = rng() % 64;
+		b[i] = a[i] + rng() % 3;
+	}
+
+	return {std::move(a), std::move(b)};
+}
+
+struct Case {
+	const char* name;
+	Sequences (*generate)(std::mt19937&, u32);
+	// Only the (nearly) identical cases are ~O(n), the others need up to
+	// O(n^2) time and memory. They are only run up to this size.
+	u32 maxSize;
+};
+
+constexpr Case cases[] = {
+	{"identical", identical, 60000u},
+	{"shifted", shifted, 20000u},
+	{"indels", indels, 10000u},
+	{"block-moves", blockMoves, 10000u},
+	{"dissimilar", dissimilar, 2000u},
+	{"fuzzy", fuzzy, 2000u},
+};
+
+void run(const Case& c, u32 size) {
+	std::mt19937 rng(size);
+	auto [a, b] = c.generate(rng, size);
+
+	auto matcher = [&](u32 i, u32 j) -> float {
+		auto va = a[i];
+		auto vb = b[j];
+		if(va == vb) {
+			return 1.f;
+		}
+
+		auto dist = va > vb ? va - vb : vb - va;
+		return dist < 3u ? 0.5f / dist : 0.f;
+	};
+
+	std::size_t bytes = 0u;
+	LinAllocator alloc(
+		[&](const std::byte*, u32 blockSize) { bytes += blockSize; },
+		[](const std::byte*, u32) {});
+
+	LazyMatrixMarchBase::Params params;
+	params.storage = LazyMatrixMarchBase::Storage::paged;
+
+	auto start = Clock::now();
+	LazyMatrixMarchT lmm(u32(a.size()), u32(b.size()), alloc, matcher, params);
+
+	auto peakCandidates = lmm.numCandidates();
+	while(lmm.step()) {
+		peakCandidates = std::max(peakCandidates, lmm.numCandidates());
+	}
+
+	auto res = lmm.run();
+	auto end = Clock::now();
+
+	auto ms = std::chrono::duration<double, std::milli>(end - start).count();
+	std::printf("%-12s %6u %10.2f %12llu %12llu %10u %12zu %10.1f\n",
+		c.name, size, ms,
+		(unsigned long long) lmm.numEvals(),
+		(unsigned long long) lmm.numSteps(),
+		peakCandidates, bytes, res.totalMatch);
+}
+
+} // anon namespace
+
+int main(int argc, char** argv) {
+	std::vector<u32> sizes;
+	for(auto i = 1; i < argc; ++i) {
+		sizes.push_back(u32(std::strtoul(argv[i], nullptr, 10)));
+	}
+
+	if(sizes.empty()) {
+		sizes = {100u, 1000u, 2000u, 10000u, 20000u, 60000u};
+	}
+
+	std::printf("%-12s %6s %10s %12s %12s %10s %12s %10s\n",
+		"case", "size", "ms", "evals", "steps", "peakCands", "bytes", "match");
+	for(auto& c : cases) {
+		for(auto size : sizes) {
+			if(size == 0u || size > c.maxSize) {
+				continue;
+			}
+
+			run(c, size);
+		}
+	}
+}
@@ -1,4 +1,6 @@
 #include <lmm.hpp>
+#include <algorithm>
+#include <cmath>
 
 namespace vil {
 
@@ -6,99 +8,681 @@ float maxPossibleScore(float score, u32 width, u32 height, u32 i, u32 j) {
 	return score + std::min(width - i, height - j);
 }
 
-// LazyMatrixMarch
-LazyMatrixMarch::LazyMatrixMarch(u32 width, u32 height, LinAllocator& alloc,
-	Matcher matcher, float branchThreshold) :
-		alloc_(alloc), width_(width), height_(height), matcher_(std::move(matcher)),
-		branchThreshold_(branchThreshold), candidates_(HeapCandCompare{*this}, alloc) {
+namespace {
 
+// Divide-and-conquer search for Storage::linear.
+// Works on the lattice of prefix lengths: point (a, b) is the state after
+// consuming a elements of the first and b elements of the second sequence,
+// the diagonal step from (a, b) to (a + 1, b + 1) matches cell (a, b).
+struct LinearMarch {
+	using ResultMatch = LazyMatrixMarchBase::ResultMatch;
+
+	// Half-open range of cells, [i0, i1) x [j0, j1).
+	struct Rect {
+		u32 i0;
+		u32 j0;
+		u32 i1;
+		u32 j1;
+	};
+
+	// Problems with at most this many lattice points (or just one row
+	// of cells) are solved directly, keeping all their scores.
+	static constexpr u32 directPoints = 4096u;
+	// Tolerance for the pruning, the scores along the same path might
+	// be summed up in different order in different passes.
+	static constexpr float slack = 0.001f;
+
+	LinAllocator& alloc;
+	const LazyMatrixMarchBase::BatchMatcher& matcher;
+	// added to the cell coordinates passed to the matcher,
+	// see Params::identical
+	u32 offset;
+	// See Params::maxMatchI, empty if not given
+	span<const float> boundsI;
+	span<const float> boundsJ;
+	span<ResultMatch> matches;
+	u32 numMatches {};
+	u64 numEvals {};
+	u64 numExtraEvals {};
+
+	void eval(span<const LmmCell> cells, span<float> values, u32 depth) {
+		if(cells.empty()) {
+			return;
+		}
+
+		matcher(cells, values);
+		numEvals += cells.size();
+
+		// The passes of the toplevel problem evaluate every cell at most
+		// once, everything after that is potentially evaluated again.
+		if(depth > 0u) {
+			numExtraEvals += cells.size();
+		}
+	}
+
+	// Writes the maximum score of the elements in [i0, i1) after the first
+	// a ones into rest[a], in reverse order with reverse.
+	static void restBounds(span<const float> bounds, u32 i0, u32 i1,
+			bool reverse, span<float> rest) {
+		auto n = i1 - i0;
+		rest[n] = 0.f;
+		for(auto a = n; a-- > 0u;) {
+			auto val = 1.f;
+			if(!bounds.empty()) {
+				val = bounds[reverse ? i1 - 1 - a : i0 + a];
+			}
+
+			rest[a] = rest[a + 1] + val;
+		}
+	}
+
+	// Follows the diagonal as long as there are matches. Otherwise looks
+	// one step ahead: skips an element in both sequences if that leads
+	// to a match again, in one of them if only that does and in the longer
+	// one otherwise. Gives the initial lower bound for the pruning, for
+	// similar sequences it is close to the best score.
+	float greedy(u32 width, u32 height) {
+		ExtZoneScoped;
+
+		auto evalCell = [&](u32 i, u32 j) {
+			LmmCell cell {offset + i, offset + j};
+			float value;
+			eval({&cell, 1u}, {&value, 1u}, 1u);
+			return value;
+		};
+
+		auto score = 0.f;
+		u32 i = 0u;
+		u32 j = 0u;
+		while(i < width && j < height) {
+			auto value = evalCell(i, j);
+			if(value > 0.f) {
+				score += value;
+				++i;
+				++j;
+				continue;
+			}
+
+			auto hasI = i + 1 < width;
+			auto hasJ = j + 1 < height;
+			if(hasI && hasJ && evalCell(i + 1, j + 1) > 0.f) {
+				++i;
+				++j;
+			} else if(hasI && evalCell(i + 1, j) > 0.f) {
+				++i;
+			} else if(hasJ && evalCell(i, j + 1) > 0.f) {
+				++j;
+			} else if(width - i > height - j) {
+				++i;
+			} else {
+				++j;
+			}
+		}
+
+		return score;
+	}
+
+	// Computes the best scores from the top left corner of the given
+	// problem to all points in its lattice row 'rows'. With reverse, the
+	// problem is traversed from its bottom right corner instead, i.e. out[a]
+	// then is the best score from lattice point (i1 - a, j1 - rows) to the
+	// bottom right corner.
+	// Points that can't be on a path with a score of at least minScore are
+	// skipped and set to -1.f. When 'table' and 'evals' are given, all rows
+	// and evaluated match values are written to them.
+	void pass(const Rect& r, u32 rows, bool reverse, float minScore,
+			u32 depth, span<float> out,
+			span<float> table = {}, span<float> evals = {}) {
+		ExtZoneScoped;
+
+		auto nx = r.i1 - r.i0;
+		auto ny = r.j1 - r.j0;
+		dlg_assert(rows <= ny);
+		dlg_assert(out.size() == nx + 1);
+
+		minScore -= slack;
+
+		LinAllocScope scope(alloc);
+		auto restI = scope.allocUndef<float>(nx + 1);
+		auto restJ = scope.allocUndef<float>(ny + 1);
+		restBounds(boundsI, r.i0, r.i1, reverse, restI);
+		restBounds(boundsJ, r.j0, r.j1, reverse, restJ);
+		auto bound = [&](float score, u32 a, u32 b) {
+			return score + std::min(restI[a], restJ[b]);
+		};
+
+		auto prev = scope.allocUndef<float>(nx + 1);
+		auto cur = scope.allocUndef<float>(nx + 1);
+		auto diag = scope.allocUndef<float>(nx);
+		auto cells = scope.allocUndef<LmmCell>(nx);
+		auto values = scope.allocUndef<float>(nx);
+
+		// Only points in [lo, hi) of prev are valid.
+		// In the first row, there are only horizontal steps and the
+		// bound never increases with a.
+		u32 lo = 0u;
+		u32 hi = 0u;
+		while(hi <= nx && bound(0.f, hi, 0u) >= minScore) {
+			prev[hi] = 0.f;
+			++hi;
+		}
+
+		auto writeRow = [&](span<float> dst) {
+			std::fill(dst.begin(), dst.begin() + lo, -1.f);
+			std::copy(prev.begin() + lo, prev.begin() + hi, dst.begin() + lo);
+			std::fill(dst.begin() + hi, dst.end(), -1.f);
+		};
+
+		if(!table.empty()) {
+			writeRow(table.first(nx + 1));
+		}
+
+		for(auto b = 0u; b < rows && lo < hi; ++b) {
+			// evaluate all cells that we could step through diagonally
+			auto numCells = 0u;
+			auto diagEnd = std::min(hi, nx);
+			for(auto a = lo; a < diagEnd; ++a) {
+				diag[a] = 0.f;
+				if(prev[a] >= 0.f && bound(prev[a] + 1.f, a + 1, b + 1) >= minScore) {
+					cells[numCells++] = reverse ?
+						LmmCell{offset + r.i1 - 1 - a, offset + r.j1 - 1 - b} :
+						LmmCell{offset + r.i0 + a, offset + r.j0 + b};
+				}
+			}
+
+			eval(cells.first(numCells), values.first(numCells), depth);
+			for(auto k = 0u; k < numCells; ++k) {
+				auto i = cells[k].i - offset;
+				auto a = reverse ? r.i1 - 1 - i : i - r.i0;
+				diag[a] = values[k];
+				if(!evals.empty()) {
+					evals[b * nx + a] = values[k];
+				}
+			}
+
+			// Nothing left of lo can be reached. Right of hi, only
+			// horizontal steps are possible, so we stop at the first
+			// point we can't reach there.
+			auto a = lo;
+			for(; a <= nx; ++a) {
+				auto score = -1.f;
+				if(a < hi) {
+					score = prev[a];
+				}
+
+				if(a > lo) {
+					score = std::max(score, cur[a - 1]);
+					if(a - 1 < diagEnd && prev[a - 1] >= 0.f && diag[a - 1] > 0.f) {
+						score = std::max(score, prev[a - 1] + diag[a - 1]);
+					}
+				}
+
+				if(score >= 0.f && bound(score, a, b + 1) < minScore) {
+					score = -1.f;
+				}
+
+				cur[a] = score;
+				if(score < 0.f && a >= hi) {
+					break;
+				}
+			}
+
+			hi = std::min(a, nx + 1);
+			while(lo < hi && cur[lo] < 0.f) {
+				++lo;
+			}
+
+			std::swap(prev, cur);
+			if(!table.empty()) {
+				writeRow(table.subspan((b + 1) * (nx + 1), nx + 1));
+			}
+		}
+
+		writeRow(out);
+	}
+
+	// Finds the best path through the given problem and appends its
+	// matches. There must be a path with a score of at least minScore.
+	void solve(const Rect& r, float minScore, u32 depth) {
+		auto nx = r.i1 - r.i0;
+		auto ny = r.j1 - r.j0;
+		if(nx == 0u || ny == 0u) {
+			return;
+		}
+
+		if(ny == 1u || std::size_t(nx + 1) * (ny + 1) <= directPoints) {
+			solveDirect(r, minScore, depth);
+			return;
+		}
+
+		// Split where the best path crosses the middle lattice row.
+		auto mid = ny / 2;
+		u32 split {};
+		float scoreTop {-1.f};
+		float scoreBottom {-1.f};
+
+		{
+			LinAllocScope scope(alloc);
+			auto fwd = scope.alloc<float>(nx + 1);
+			auto bwd = scope.alloc<float>(nx + 1);
+			pass(r, mid, false, minScore, depth, fwd);
+			pass(r, ny - mid, true, minScore, depth, bwd);
+
+			for(auto a = 0u; a <= nx; ++a) {
+				auto top = fwd[a];
+				auto bottom = bwd[nx - a];
+				if(top >= 0.f && bottom >= 0.f && top + bottom > scoreTop + scoreBottom) {
+					split = a;
+					scoreTop = top;
+					scoreBottom = bottom;
+				}
+			}
+		}
+
+		// From here on, we know the exact scores of the subproblems
+		dlg_assert(scoreTop >= 0.f && scoreBottom >= 0.f);
+		solve({r.i0, r.j0, r.i0 + split, r.j0 + mid}, scoreTop, depth + 1);
+		solve({r.i0 + split, r.j0 + mid, r.i1, r.j1}, scoreBottom, depth + 1);
+	}
+
+	void solveDirect(const Rect& r, float minScore, u32 depth) {
+		ExtZoneScoped;
+
+		auto nx = r.i1 - r.i0;
+		auto ny = r.j1 - r.j0;
+
+		LinAllocScope scope(alloc);
+		auto table = scope.allocUndef<float>(std::size_t(nx + 1) * (ny + 1));
+		auto evals = scope.alloc<float>(std::size_t(nx) * ny);
+		auto last = scope.allocUndef<float>(nx + 1);
+		pass(r, ny, false, minScore, depth, last, table, evals);
+
+		auto at = [&](u32 a, u32 b) { return table[b * (nx + 1) + a]; };
+		dlg_assert(at(nx, ny) >= 0.f);
+
+		// trace back, matches are found in reverse order
+		auto first = numMatches;
+		auto a = nx;
+		auto b = ny;
+		while(a > 0 && b > 0) {
+			auto score = at(a, b);
+			if(at(a, b - 1) == score) {
+				--b;
+			} else if(at(a - 1, b) == score) {
+				--a;
+			} else {
+				--a;
+				--b;
+
+				auto value = evals[b * nx + a];
+				dlg_assert(value > 0.f);
+				dlg_assert(numMatches < matches.size());
+				matches[numMatches++] = {r.i0 + a, r.j0 + b, value};
+			}
+		}
+
+		std::reverse(matches.begin() + first, matches.begin() + numMatches);
+	}
+};
+
+} // anon namespace
+
+// LazyMatrixMarchCore
+template<typename IndexT, typename CellT>
+LazyMatrixMarchCore<IndexT, CellT>::LazyMatrixMarchCore(u32 width, u32 height,
+	LinAllocator& alloc, const Params& params) :
+		alloc_(alloc), width_(width), height_(height),
+		storage_(params.storage), queue_(params.queue),
+		identical_(params.identical),
+		matchBound_(params.matchBound),
+		branchThreshold_(params.branchThreshold),
+		beamWidth_(params.beamWidth),
+		pruneScale_(1.f / (1.f - params.maxSuboptimality)),
+		maxMatchI_(params.maxMatchI), maxMatchJ_(params.maxMatchJ),
+		candidates_(HeapCandCompare{*this}, MyAlloc<HeapCand>(alloc, nodeFreeList_)) {
+	init(width, height);
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::init(u32 width, u32 height) {
 	dlg_assert(width > 0);
 	dlg_assert(height > 0);
-	// if we ever exceed this, just use 32-bit integers for HeapCand.
-	// Not that big of a loss, 16-bit was done because of performance
-	// and memory concerns. Who matches such HUGE sequences?!
-	dlg_assert(width < 1024 * 64);
-	dlg_assert(height < 1024 * 64);
-	dlg_assert(matcher_);
 
-	matchMatrix_ = alloc.allocNonTrivial<EvalMatch>(width * height);
+	width_ = width;
+	height_ = height;
+	prefix_ = 0u;
+	suffix_ = 0u;
+
+	if(identical_) {
+		ExtZoneScoped;
+
+		auto maxTrim = std::min(width, height);
+		while(prefix_ < maxTrim && identical_(prefix_, prefix_)) {
+			++prefix_;
+		}
+
+		while(prefix_ + suffix_ < maxTrim &&
+				identical_(width - 1 - suffix_, height - 1 - suffix_)) {
+			++suffix_;
+		}
+
+		width_ -= prefix_ + suffix_;
+		height_ -= prefix_ + suffix_;
+	}
+
+	// All coordinates must be representable in a HeapCand,
+	// use IndexT = u32 for larger sequences.
+	dlg_assert(width_ == 0u || width_ - 1 <= maxIndex);
+	dlg_assert(height_ == 0u || height_ - 1 <= maxIndex);
+
+	initBounds();
+
+	// Everything happens in runLinear. When one of the sequences
+	// was trimmed completely, there is nothing to do.
+	if(storage_ == Storage::linear || width_ == 0u || height_ == 0u) {
+		return;
+	}
+
+	// We never write to the matrix here, cells are initialized
+	// on first access, see EvalMatch::gen and CompactMatch.
+	if(storage_ == Storage::dense) {
+		auto numCells = std::size_t(width_) * height_;
+		if(matchMatrix_.size() < numCells) {
+			matchMatrix_ = allocZeroed<CellT>(numCells);
+		}
+	} else {
+		tilesX_ = (width_ + tileMask) >> tileShift;
+		auto tilesY = (height_ + tileMask) >> tileShift;
+		auto numTiles = std::size_t(tilesX_) * tilesY;
+		if(tiles_.size() < numTiles) {
+			tiles_ = allocZeroed<CellT*>(numTiles);
+		}
+	}
 
-	for(auto& m : matchMatrix_) {
-		m.candidate = candidates_.end();
+	if(queue_ == Queue::buckets) {
+		auto maxBound = u32(std::ceil(maxPossibleScore(0.f, 0u, 0u)));
+		auto numBuckets = std::size_t(maxBound) * bucketsPerUnit + 1;
+		if(buckets_.size() < numBuckets) {
+			// keep the storage of the old buckets
+			auto old = buckets_;
+			buckets_ = alloc_.alloc<CandArray>(numBuckets);
+			std::copy(old.begin(), old.end(), buckets_.begin());
+		}
 	}
 
 	// insert first candidate
-	auto it = candidates_.insert({0, 0, 0.f}).first;
-	match(0, 0).best = 0.f;
-	match(0, 0).candidate = it;
+	insertCandidate({0, 0, 0.f}, maxPossibleScore(0.f, 0u, 0u));
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::resetState(u32 width, u32 height) {
+	ExtZoneScoped;
+
+	// candidates, set nodes go to the free-list
+	candidates_.clear();
+	heap_.size = 0u;
+	for(auto& bucket : buckets_) {
+		bucket.size = 0u;
+	}
+
+	lowBucket_ = 0u;
+	topBucket_ = 0u;
+	numCandidates_ = 0u;
+	pruneScore_ = -1.f;
+
+	if(storage_ != Storage::linear && width_ > 0u && height_ > 0u) {
+		clearCells();
+	}
+
+	bestMatch_ = -1.f;
+	discardBound_ = -1.f;
+	bestRes_ = {};
+	hintBest_ = false;
+	hintPath_ = {};
+
+	numEvals_ = 0u;
+	numSteps_ = 0u;
+	numExtraEvals_ = 0u;
+	numDropped_ = 0u;
+	numBounds_ = 0u;
+	numTiles_ = 0u;
+
+	init(width, height);
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::initBounds() {
+	if(!maxMatchI_ && !maxMatchJ_) {
+		boundsI_ = boundsJ_ = restI_ = restJ_ = {};
+		return;
+	}
+
+	ExtZoneScoped;
+
+	auto size = 2 * (std::size_t(width_) + height_ + 1);
+	if(boundBuf_.size() < size) {
+		boundBuf_ = alloc_.allocUndef<float>(size);
+	}
+
+	auto buf = boundBuf_;
+	boundsI_ = buf.subspan(0u, width_);
+	restI_ = buf.subspan(width_, width_ + 1);
+	boundsJ_ = buf.subspan(2 * width_ + 1, height_);
+	restJ_ = buf.subspan(2 * width_ + 1 + height_, height_ + 1);
+
+	// Bounds above 1.f are valid but useless
+	auto fill = [&](const std::function<float(u32)>& maxMatch,
+			span<float> bounds, span<float> rest) {
+		rest[bounds.size()] = 0.f;
+		for(auto k = u32(bounds.size()); k-- > 0u;) {
+			bounds[k] = maxMatch ? std::min(maxMatch(k + prefix_), 1.f) : 1.f;
+			dlg_assert(bounds[k] >= 0.f);
+			rest[k] = rest[k + 1] + bounds[k];
+		}
+	};
+
+	fill(maxMatchI_, boundsI_, restI_);
+	fill(maxMatchJ_, boundsJ_, restJ_);
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::clearCells() {
+	// Stamped cells only need a new generation. Once it wraps around,
+	// the stale cells might look valid again, so clear them.
+	auto clear = true;
+	if constexpr(CellT::stamped) {
+		clear = (++gen_ == 0u);
+		if(clear) {
+			gen_ = 1u;
+		}
+	}
+
+	if(storage_ == Storage::dense) {
+		if(clear) {
+			auto numCells = std::size_t(width_) * height_;
+			if constexpr(CellT::stamped) {
+				numCells = matchMatrix_.size();
+			}
+
+			std::memset(static_cast<void*>(matchMatrix_.data()), 0x0,
+				numCells * sizeof(CellT));
+		}
+
+		return;
+	}
+
+	auto tilesY = (height_ + tileMask) >> tileShift;
+	for(auto& tile : tiles_.first(std::size_t(tilesX_) * tilesY)) {
+		if(!tile) {
+			continue;
+		}
+
+		if(clear) {
+			std::memset(static_cast<void*>(tile), 0x0,
+				tileSize * tileSize * sizeof(CellT));
+		}
+
+		std::memcpy(static_cast<void*>(tile), &freeTiles_, sizeof(CellT*));
+		freeTiles_ = tile;
+		tile = nullptr;
+	}
+}
+
+template<typename IndexT, typename CellT>
+span<LazyMatrixMarchBase::ResultMatch> LazyMatrixMarchCore<IndexT, CellT>::reuse(
+		span<ResultMatch>& buf, std::size_t n) {
+	if(buf.size() < n) {
+		// NOTE: the old buffer isn't freed. Growing exponentially bounds
+		// the waste by the size of the new buffer.
+		buf = alloc_.allocUndef<ResultMatch>(std::max(n, 2 * buf.size()));
+	}
+
+	return buf.first(n);
+}
+
+template<typename IndexT, typename CellT>
+template<typename T>
+span<T> LazyMatrixMarchCore<IndexT, CellT>::allocZeroed(std::size_t n) {
+	static_assert(std::is_trivially_destructible_v<T>);
+
+	// Small allocations are cheap to initialize and we want to avoid
+	// the malloc overhead. For large ones, calloc allows the OS to
+	// hand out lazily mapped zero pages, so only the pages we actually
+	// touch will ever be faulted in.
+	if(n * sizeof(T) < LinAllocator::maxBlockSize) {
+		return alloc_.alloc<T>(n);
+	}
+
+	// When growing the matrix in reset(), this frees the old one.
+	auto* ptr = std::calloc(n, sizeof(T));
+	if(!ptr) {
+		throw std::bad_alloc();
+	}
+
+	zeroedBlock_.reset(static_cast<std::byte*>(ptr));
+	return {static_cast<T*>(ptr), n};
 }
 
-void LazyMatrixMarch::addCandidate(float score, u32 i, u32 j, u32 addI, u32 addJ) {
+template<typename IndexT, typename CellT>
+CellT* LazyMatrixMarchCore<IndexT, CellT>::allocTile() {
+	ExtZoneScoped;
+	++numTiles_;
+	if(freeTiles_) {
+		// all cells already untouched, see clearCells
+		auto* tile = freeTiles_;
+		std::memcpy(&freeTiles_, static_cast<void*>(tile), sizeof(CellT*));
+		std::memset(static_cast<void*>(tile), 0x0, sizeof(CellT*));
+		return tile;
+	}
+
+	return alloc_.allocRaw<CellT>(tileSize * tileSize);
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::addCandidate(float score, u32 i, u32 j, u32 addI, u32 addJ) {
 	ExtZoneScoped;
 
 	if(i + addI >= width() || j + addJ >= height()) {
 		// we have a finished run.
 		if(score > bestMatch_) {
 			bestMatch_ = score;
+			hintBest_ = false;
 			dlg_assert(i < width());
 			dlg_assert(j < height());
 			bestRes_ = {i, j};
+			if(pruneScale_ > 1.f) {
+				pinBest();
+			}
+
+			// With Params::maxMatchI, the bounds of other candidates
+			// might be below the new score already
+			prune(pruneLimit());
 		}
 
 		return;
 	}
 
 	auto maxPossible = maxPossibleScore(score, i + addI, j + addJ);
-	if(maxPossible > bestMatch_) {
+	if(maxPossible > bestMatch_ && maxPossible < pruneLimit()) {
+		discard(maxPossible);
+	} else if(maxPossible > bestMatch_) {
 		// NOTE: retrieving this here kinda costly and redundant to the
 		// check in step(). But it's an early out that cuts down
 		// the number of steps/candidates a lot so probably worth doing
 		// (we otherwise early-out in step() often).
 		auto& m = match(i + addI, j + addJ);
-		if(m.best < score) {
-			if(m.candidate != candidates_.end()) {
-				candidates_.erase(m.candidate);
-			}
-
-			auto [it, succ] = candidates_.insert({u16(i + addI), u16(j + addJ), score});
-			dlg_assert(succ);
-			m.candidate = it;
-			m.best = score;
+		if(m.best() < score) {
+			insertCandidate({IndexT(i + addI), IndexT(j + addJ), score}, maxPossible);
 		}
 	}
 }
 
-bool LazyMatrixMarch::step() {
-	ExtZoneScoped;
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::insertCandidate(const HeapCand& cand, float bound) {
+	auto& m = match(cand.i, cand.j);
+	dlg_assert(m.best() < cand.score);
 
-	if(empty()) {
-		return false;
-	}
+	if(queue_ == Queue::set) {
+		if(m.candidate()) {
+			[[maybe_unused]] auto count = candidates_.erase({cand.i, cand.j, m.best()});
+			dlg_assert(count == 1u);
+		}
 
-	++numSteps_;
-	auto cand = popCandidate();
+		[[maybe_unused]] auto succ = candidates_.insert(cand).second;
+		dlg_assert(succ);
+		m.setCandidate(1u);
+		m.setBest(cand.score);
+	} else if(queue_ == Queue::buckets) {
+		// a previous candidate for this field will be discarded when
+		// it reaches the top of its bucket since its score won't match
+		// the field anymore.
+		if(!m.candidate()) {
+			++numCandidates_;
+		}
 
-	// should be true due to pruning
-	dlg_assert(maxPossibleScore(cand) >= bestMatch_);
+		m.setCandidate(1u);
+		m.setBest(cand.score);
+		pushBucket({bound, cand});
+	} else {
+		m.setBest(cand.score);
 
-	auto& m = this->match(cand.i, cand.j);
-	m.candidate = candidates_.end();
+		// Since the field is the same, the bound increases by the same
+		// amount as the score. So we only ever have to sift up.
+		u32 pos;
+		if(m.candidate()) {
+			pos = m.candidate() - 1;
+			dlg_assert(heap_.data[pos].cand.i == cand.i);
+			dlg_assert(heap_.data[pos].cand.j == cand.j);
+		} else {
+			if(heap_.size == heap_.capacity) {
+				growCandArray(heap_);
+			}
 
-	// this invariant follows from the way we insert new candidates
-	// there is always at most one candidate per field
-	dlg_assert(m.best == cand.score);
+			pos = heap_.size;
+			++heap_.size;
+		}
 
-	if(m.eval == -1.f) {
-		m.eval = matcher_(cand.i, cand.j);
-		++numEvals_;
+		heap_.data[pos] = {bound, cand};
+		siftUpHeap(pos);
+		settleHeap();
 	}
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::expand(const HeapCand& cand, const CellT& m) {
+	dlg_assert(m.evaluated() || m.bounded());
 
-	if(m.eval > 0.f) {
-		auto newScore = cand.score + m.eval;
+	// Without evaluation, a match here can't lead to a better path,
+	// see deferEval.
+	auto eval = m.evaluated() ? m.eval() : 0.f;
+	if(eval > 0.f) {
+		auto newScore = cand.score + eval;
 		addCandidate(newScore, cand.i, cand.j, 1, 1);
 
-		// throw out all candidates that can't even reach what we have
-		prune(newScore);
+		// throw out all candidates that can't even reach what we have.
+		// With a beam, the new candidate might be dropped later on,
+		// so only complete paths are a safe lower bound.
+		prune(std::max(pruneLimit(), beamWidth_ ? 0.f : newScore));
 	}
 
 	// NOTE: yeah with fuzzy matching we should always branch
@@ -108,78 +692,530 @@ bool LazyMatrixMarch::step() {
 	// candidates total.
 	// NOTE: only threshold = 1.f is guaranteed to be 100% correct,
 	// otherwise it's a heuristic.
-	if(m.eval < branchThreshold_) {
+	if(eval < branchThreshold_) {
 		addCandidate(cand.score, cand.i, cand.j, 1, 0);
 		addCandidate(cand.score, cand.i, cand.j, 0, 1);
+	} else if(eval < 1.f) {
+		// After a perfect match, the skipped paths can't be better.
+		// Otherwise, they might be.
+		if(cand.i + 1u < width()) {
+			discard(maxPossibleScore(cand.score, cand.i + 1, cand.j));
+		}
+
+		if(cand.j + 1u < height()) {
+			discard(maxPossibleScore(cand.score, cand.i, cand.j + 1));
+		}
 	}
+}
 
-	return true;
+template<typename IndexT, typename CellT>
+bool LazyMatrixMarchCore<IndexT, CellT>::deferEval(const HeapCand& cand, CellT& m) {
+	if(!matchBound_) {
+		return false;
+	}
+
+	// The bound is kept, the field might be expanded again with
+	// a better score.
+	if(!m.bounded()) {
+		auto bound = matchBound_(cand.i + prefix_, cand.j + prefix_);
+		++numBounds_;
+		if(bound <= 0.f) {
+			m.setEval(0.f);
+			return true;
+		}
+
+		m.setBound(bound);
+	}
+
+	// Only the diagonal successor depends on the match value.
+	// Past the end, this is the score of the finished path.
+	auto diagBound = maxPossibleScore(cand.score + m.bound(), cand.i + 1, cand.j + 1);
+	if(diagBound <= bestMatch_) {
+		return true;
+	} else if(diagBound < pruneLimit()) {
+		discard(diagBound);
+		return true;
+	}
+
+	return false;
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::seedHint(span<const ResultMatch> hint,
+		const BatchMatcher& matcher) {
+	ExtZoneScoped;
+	dlg_assert(numSteps_ == 0u);
+
+	// Only keep the part of the hint that is a valid path here.
+	// Matches in the trimmed prefix and suffix are implicit.
+	auto path = reuse(hintBuf_, hint.size());
+	auto numPath = 0u;
+	for(auto match : hint) {
+		if(match.i < prefix_ || match.j < prefix_) {
+			continue;
+		}
+
+		match.i -= prefix_;
+		match.j -= prefix_;
+		if(match.i >= width() || match.j >= height()) {
+			continue;
+		}
+
+		if(numPath > 0u && (match.i <= path[numPath - 1].i ||
+				match.j <= path[numPath - 1].j)) {
+			continue;
+		}
+
+		path[numPath++] = match;
+	}
+
+	{
+		LinAllocScope scope(alloc_);
+		auto cells = scope.alloc<LmmCell>(numPath);
+		auto values = scope.alloc<float>(numPath);
+		for(auto k = 0u; k < numPath; ++k) {
+			cells[k] = {path[k].i + prefix_, path[k].j + prefix_};
+		}
+
+		matcher(cells, values);
+		numEvals_ += numPath;
+
+		for(auto k = 0u; k < numPath; ++k) {
+			path[k].matchVal = values[k];
+		}
+	}
+
+	if(storage_ == Storage::linear) {
+		// the passes will evaluate them again
+		numExtraEvals_ += numPath;
+	} else {
+		// Remember the evaluations so the search does not repeat them.
+		// For CompactMatch, this quantizes them.
+		for(auto k = 0u; k < numPath; ++k) {
+			auto& m = match(path[k].i, path[k].j);
+			m.setEval(path[k].matchVal);
+			path[k].matchVal = m.eval();
+		}
+	}
+
+	// only keep the actual matches
+	auto score = 0.f;
+	auto numMatches = 0u;
+	for(auto k = 0u; k < numPath; ++k) {
+		if(path[k].matchVal > 0.f) {
+			score += path[k].matchVal;
+			path[numMatches++] = path[k];
+		}
+	}
+
+	if(score > bestMatch_) {
+		bestMatch_ = score;
+		hintBest_ = true;
+		hintPath_ = path.first(numMatches);
+		if(storage_ != Storage::linear) {
+			prune(pruneLimit());
+		}
+	}
 }
 
-LazyMatrixMarch::Result LazyMatrixMarch::run() {
+template<typename IndexT, typename CellT>
+LazyMatrixMarchBase::Result LazyMatrixMarchCore<IndexT, CellT>::gatherResult() {
 	ExtZoneScoped;
 
-	// run algorithm
-	while(step()) /*noop*/;
+	if(width_ == 0u || height_ == 0u) {
+		return addTrimmed({0.f, {}});
+	}
+
+	if(hintBest_) {
+		return addTrimmed({bestMatch_, hintPath_, false, gapTo(bestMatch_)});
+	}
 
-	// gather results
 	Result res;
 	auto maxMatches = std::min(width(), height());
-	res.matches = alloc_.alloc<ResultMatch>(maxMatches);
+	res.matches = reuse(pathBuf_, maxMatches);
 	res.totalMatch = bestMatch_;
+	res.gap = gapTo(bestMatch_);
 	auto outID = maxMatches;
 
 	dlg_assert(bestMatch_ >= 0.f);
 
 	auto [i, j] = bestRes_;
-	auto& lastMatch = match(i, j);
-	dlg_assert(bestMatch_ >= lastMatch.best);
-	dlg_assert(bestMatch_ - lastMatch.best <= 1.f);
-	if(lastMatch.eval > 0.f) {
-		res.matches[outID - 1] = {i, j, lastMatch.eval};
+	auto& lastMatch = matchData(i, j);
+	dlg_assert(bestMatch_ >= lastMatch.best());
+	dlg_assert(bestMatch_ - lastMatch.best() <= 1.001f);
+	if(lastMatch.eval() > 0.f) {
+		res.matches[outID - 1] = {i, j, lastMatch.eval()};
 		--outID;
 	}
 
+	[[maybe_unused]] auto traced = traceBack(i, j, res.matches, outID);
+	dlg_assertm(traced, "Inconsistent best path");
+
+	res.matches = res.matches.last(maxMatches - outID);
+	return addTrimmed(res);
+}
+
+template<typename IndexT, typename CellT>
+LazyMatrixMarchBase::Result LazyMatrixMarchCore<IndexT, CellT>::traceResult(
+		const MatchVisitor& visitor) {
+	ExtZoneScoped;
+
+	Result res {};
+	res.totalMatch = float(prefix_ + suffix_);
+
+	for(auto k = suffix_; k-- > 0u;) {
+		visitor({prefix_ + width_ + k, prefix_ + height_ + k, 1.f});
+	}
+
+	auto visit = [&](const ResultMatch& match) {
+		visitor({match.i + prefix_, match.j + prefix_, match.matchVal});
+	};
+
+	if(width_ > 0u && height_ > 0u) {
+		dlg_assert(bestMatch_ >= 0.f);
+		res.totalMatch += bestMatch_;
+		res.gap = gapTo(bestMatch_);
+
+		if(hintBest_) {
+			for(auto k = hintPath_.size(); k-- > 0u;) {
+				visit(hintPath_[k]);
+			}
+		} else {
+			auto [i, j] = bestRes_;
+			auto& lastMatch = matchData(i, j);
+			if(lastMatch.eval() > 0.f) {
+				visit({i, j, lastMatch.eval()});
+			}
+
+			[[maybe_unused]] auto traced = walkBack(i, j, visit);
+			dlg_assertm(traced, "Inconsistent best path");
+		}
+	}
+
+	for(auto k = prefix_; k-- > 0u;) {
+		visitor({k, k, 1.f});
+	}
+
+	return res;
+}
+
+template<typename IndexT, typename CellT>
+template<typename F>
+bool LazyMatrixMarchCore<IndexT, CellT>::walkBack(u32 i, u32 j, F&& onMatch) {
 	while(i > 0 && j > 0) {
-		auto& score = match(i, j);
-		auto& up = match(i, j - 1);
-		if(up.best == score.best) {
+		auto& score = matchData(i, j);
+		auto& up = matchData(i, j - 1);
+		if(up.best() == score.best()) {
 			--j;
 			continue;
 		}
 
-		auto& left = match(i - 1, j);
-		if(left.best == score.best) {
+		auto& left = matchData(i - 1, j);
+		if(left.best() == score.best()) {
 			--i;
 			continue;
 		}
 
-		auto& diag = match(i - 1, j - 1);
-		dlg_assert(diag.best < score.best);
-		dlg_assertm(diag.eval > 0.f && diag.eval <= 1.f, "{}", diag.eval);
-		dlg_assertm(std::abs(diag.eval - (score.best - diag.best)) < 0.001,
-			"diag.eval: {}, score.best: {}, diag.best: {}",
-			diag.eval, score.best, diag.best);
+		// Scores are always computed exactly like this, see expand
+		auto& diag = matchData(i - 1, j - 1);
+		if(!(diag.eval() > 0.f) || diag.best() + diag.eval() != score.best()) {
+			return false;
+		}
 
 		--i;
 		--j;
 
+		onMatch(ResultMatch{i, j, diag.eval()});
+	}
+
+	return true;
+}
+
+template<typename IndexT, typename CellT>
+bool LazyMatrixMarchCore<IndexT, CellT>::traceBack(u32 i, u32 j,
+		span<ResultMatch> out, u32& outID) {
+	return walkBack(i, j, [&](const ResultMatch& match) {
 		dlg_assert(outID != 0);
-		res.matches[outID - 1] = {i, j, diag.eval};
-		--outID;
+		out[--outID] = match;
+	});
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::pinBest() {
+	ExtZoneScoped;
+
+	// Improvements of cells on the path that stay below pruneLimit()
+	// are not propagated, so the path can't necessarily be traced back
+	// once the search is done.
+	// Even now, an earlier candidate of the same stepBatch might have
+	// improved one of its cells. Unlike traceBack, we therefore only
+	// require each cell to reach the score the path needs there. Since
+	// scores only ever increase, the predecessor it was reached from
+	// still does. The path found this way is at least as good.
+	auto maxMatches = std::min(width(), height());
+	auto out = reuse(hintBuf_, maxMatches);
+	auto outID = maxMatches;
+
+	auto [i, j] = bestRes_;
+	auto& lastMatch = matchData(i, j);
+	auto needed = lastMatch.best();
+	if(lastMatch.eval() > 0.f) {
+		out[--outID] = {i, j, lastMatch.eval()};
+	}
+
+	while(i > 0 && j > 0) {
+		if(matchData(i, j - 1).best() >= needed) {
+			--j;
+			continue;
+		}
+
+		if(matchData(i - 1, j).best() >= needed) {
+			--i;
+			continue;
+		}
+
+		--i;
+		--j;
+
+		auto& diag = matchData(i, j);
+		dlg_assertm(diag.eval() > 0.f && diag.best() + diag.eval() >= needed,
+			"Inconsistent best path");
+		needed -= diag.eval();
+
+		dlg_assert(outID != 0);
+		out[--outID] = {i, j, diag.eval()};
+	}
+
+	hintBest_ = true;
+	hintPath_ = out.subspan(outID, maxMatches - outID);
+
+	auto score = 0.f;
+	for(auto& match : hintPath_) {
+		score += match.matchVal;
+	}
+
+	bestMatch_ = std::max(bestMatch_, score);
+}
+
+template<typename IndexT, typename CellT>
+LazyMatrixMarchBase::Result LazyMatrixMarchCore<IndexT, CellT>::finishEarly(
+		const BatchMatcher& matcher) {
+	ExtZoneScoped;
+	dlg_assert(!empty());
+
+	// The complete path might pass cells whose improvement wasn't
+	// propagated yet. Then it can't be traced back anymore.
+	if(bestMatch_ >= 0.f && !hintBest_) {
+		auto maxMatches = std::min(width(), height());
+		auto out = reuse(pathBuf_, maxMatches);
+		auto outID = maxMatches;
+
+		auto [i, j] = bestRes_;
+		auto& lastMatch = matchData(i, j);
+		if(lastMatch.eval() > 0.f) {
+			out[--outID] = {i, j, lastMatch.eval()};
+		}
+
+		if(traceBack(i, j, out, outID)) {
+			Result res;
+			res.totalMatch = bestMatch_;
+			res.matches = out.last(maxMatches - outID);
+			res.approximate = true;
+			res.gap = gapTo(res.totalMatch);
+			return addTrimmed(res);
+		}
+	} else if(hintBest_) {
+		auto res = gatherResult();
+		res.approximate = true;
+		return res;
+	}
+
+	auto maxMatches = std::min(width(), height());
+	auto out = reuse(pathBuf_, maxMatches);
+	auto outID = maxMatches;
+
+	// completeTop might change the top candidate
+	Result res;
+	auto bound = peekBound();
+	res.totalMatch = completeTop(matcher, out, outID);
+	res.matches = out.subspan(outID, maxMatches - outID);
+	res.approximate = true;
+	res.gap = std::max(gapTo(res.totalMatch), bound - res.totalMatch);
+	return addTrimmed(res);
+}
+
+template<typename IndexT, typename CellT>
+float LazyMatrixMarchCore<IndexT, CellT>::completeTop(const BatchMatcher& matcher,
+		span<ResultMatch> out, u32& outID) {
+	ExtZoneScoped;
+	dlg_assert(!empty());
+
+	// Evaluates (i, j) if needed. Goes through the matrix so that
+	// the values are consistent with the traced back part.
+	auto eval = [&](u32 i, u32 j) {
+		auto& m = match(i, j);
+		if(!m.evaluated()) {
+			LmmCell cell {i + prefix_, j + prefix_};
+			float value;
+			matcher(span<const LmmCell>(&cell, 1u), span<float>(&value, 1u));
+			m.setEval(value);
+			++numEvals_;
+		}
+
+		return m.eval();
+	};
+
+	auto cand = peekCandidate();
+
+	// Greedily complete the path from the candidate, starting at the
+	// end of out. Take every match on the way, otherwise step
+	// towards the better of the right and bottom neighbor.
+	auto greedy = out.first(outID).last(std::min(width() - cand.i, height() - cand.j));
+	auto numGreedy = 0u;
+	auto score = cand.score;
+	u32 i = cand.i;
+	u32 j = cand.j;
+	while(i < width() && j < height()) {
+		auto value = eval(i, j);
+		if(value > 0.f) {
+			greedy[numGreedy++] = {i, j, value};
+			score += value;
+			++i;
+			++j;
+		} else if(i + 1 == width()) {
+			++j;
+		} else if(j + 1 == height()) {
+			++i;
+		} else {
+			auto right = eval(i + 1, j);
+			auto down = eval(i, j + 1);
+			if(right == 0.f && down == 0.f) {
+				++i;
+				++j;
+			} else if(right >= down) {
+				++i;
+			} else {
+				++j;
+			}
+		}
+	}
+
+	// Move the greedy part to the end, so the traced back part fits
+	// in front of it.
+	std::copy_backward(greedy.begin(), greedy.begin() + numGreedy,
+		out.begin() + outID);
+	outID -= numGreedy;
+	[[maybe_unused]] auto traced = traceBack(cand.i, cand.j, out, outID);
+	// Cells on the path to the top candidate can't have been improved:
+	// their maxPossibleScore would be higher than the one of the top
+	// candidate, so they would be on top instead.
+	dlg_assertm(traced, "Inconsistent candidate path");
+
+	return score;
+}
+
+template<typename IndexT, typename CellT>
+LazyMatrixMarchBase::Result LazyMatrixMarchCore<IndexT, CellT>::addTrimmed(
+		const Result& middle) {
+	if(prefix_ == 0u && suffix_ == 0u) {
+		return middle;
+	}
+
+	Result res;
+	res.totalMatch = middle.totalMatch + prefix_ + suffix_;
+	res.approximate = middle.approximate;
+	res.gap = middle.gap;
+	res.matches = reuse(trimmedBuf_, prefix_ + middle.matches.size() + suffix_);
+
+	auto out = res.matches.begin();
+	for(auto k = 0u; k < prefix_; ++k) {
+		*(out++) = {k, k, 1.f};
+	}
+
+	for(auto& match : middle.matches) {
+		*(out++) = {match.i + prefix_, match.j + prefix_, match.matchVal};
+	}
+
+	for(auto k = 0u; k < suffix_; ++k) {
+		*(out++) = {prefix_ + width_ + k, prefix_ + height_ + k, 1.f};
 	}
 
-	res.matches = res.matches.last(maxMatches - outID);
 	return res;
 }
 
-float LazyMatrixMarch::maxPossibleScore(float score, u32 i, u32 j) const {
+template<typename IndexT, typename CellT>
+LazyMatrixMarchBase::Result LazyMatrixMarchCore<IndexT, CellT>::runLinear(
+		const BatchMatcher& matcher) {
+	ExtZoneScoped;
+	dlg_assert(storage_ == Storage::linear);
+
+	if(width_ == 0u || height_ == 0u) {
+		return addTrimmed({0.f, {}});
+	}
+
+	auto matches = reuse(pathBuf_, std::min(width(), height()));
+	LinearMarch march {alloc_, matcher, prefix_, boundsI_, boundsJ_, matches};
+
+	auto minScore = hintBest_ ? bestMatch_ : march.greedy(width(), height());
+	march.solve({0u, 0u, width(), height()}, minScore, 0u);
+
+	Result res;
+	res.matches = march.matches.first(march.numMatches);
+	res.totalMatch = 0.f;
+	for(auto& match : res.matches) {
+		res.totalMatch += match.matchVal;
+	}
+
+	numEvals_ += march.numEvals;
+	numExtraEvals_ += march.numExtraEvals;
+	return addTrimmed(res);
+}
+
+template<typename IndexT, typename CellT>
+float LazyMatrixMarchCore<IndexT, CellT>::gapTo(float score) const {
+	// Any better path must go through a discarded or remaining candidate
+	auto bound = discardBound_;
+	if(!empty()) {
+		bound = std::max(bound, peekBound());
+	}
+
+	return std::max(bound - score, 0.f);
+}
+
+template<typename IndexT, typename CellT>
+float LazyMatrixMarchCore<IndexT, CellT>::maxPossibleScore(float score, u32 i, u32 j) const {
+	if(!restI_.empty()) {
+		return score + std::min(restI_[i], restJ_[j]);
+	}
+
 	return vil::maxPossibleScore(score, width_, height_, i, j);
 }
 
-LazyMatrixMarch::HeapCand LazyMatrixMarch::popCandidate() {
+template<typename IndexT, typename CellT>
+typename LazyMatrixMarchCore<IndexT, CellT>::HeapCand LazyMatrixMarchCore<IndexT, CellT>::popCandidate() {
 	dlg_assert(!empty());
 
+	if(queue_ == Queue::heap) {
+		// settleHeap guarantees that the top wasn't pruned
+		auto cand = heap_.data[0].cand;
+		--heap_.size;
+		if(heap_.size > 0u) {
+			heap_.data[0] = heap_.data[heap_.size];
+			siftDownHeap(0u);
+		}
+
+		settleHeap();
+		return cand;
+	} else if(queue_ == Queue::buckets) {
+		// settleBuckets guarantees that the top is a valid candidate
+		auto& bucket = buckets_[topBucket_];
+		auto cand = bucket.data[0].cand;
+		popBucket(bucket);
+		--numCandidates_;
+		settleBuckets();
+		return cand;
+	}
+
 	auto it = candidates_.end();
 	--it;
 	auto cand = *it;
@@ -187,27 +1223,59 @@ LazyMatrixMarch::HeapCand LazyMatrixMarch::popCandidate() {
 	return cand;
 }
 
-LazyMatrixMarch::HeapCand LazyMatrixMarch::peekCandidate() const {
+template<typename IndexT, typename CellT>
+typename LazyMatrixMarchCore<IndexT, CellT>::HeapCand LazyMatrixMarchCore<IndexT, CellT>::peekCandidate() const {
+	if(queue_ == Queue::heap) {
+		dlg_assert(!empty());
+		return heap_.data[0].cand;
+	} else if(queue_ == Queue::buckets) {
+		dlg_assert(!empty());
+		return buckets_[topBucket_].data[0].cand;
+	}
+
 	auto it = candidates_.end();
 	--it;
 	return *it;
 }
 
-void LazyMatrixMarch::prune(float minScore) {
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::prune(float minScore) {
 	ExtZoneScoped;
 
+	if(queue_ == Queue::heap) {
+		// Removing arbitrary candidates from the heap is expensive,
+		// we discard them when they reach the top instead.
+		pruneScore_ = std::max(pruneScore_, minScore);
+		settleHeap();
+		return;
+	} else if(queue_ == Queue::buckets) {
+		// All buckets below minScore can be dropped as a whole.
+		// Invalid candidates in the bucket containing minScore are
+		// discarded lazily, see settleBuckets.
+		pruneScore_ = std::max(pruneScore_, minScore);
+		auto end = std::min(u32(minScore * bucketsPerUnit), u32(buckets_.size()));
+		for(; lowBucket_ < end; ++lowBucket_) {
+			clearBucket(buckets_[lowBucket_]);
+		}
+
+		settleBuckets();
+		return;
+	}
+
 	// for this to work correctly, it's important that maxPossibleScore
 	// is always the primary criterion in the heap comparison function
 
 	auto it = candidates_.begin();
 	for(; it != candidates_.end(); ++it) {
-		if(maxPossibleScore(*it) >= minScore) {
+		auto bound = maxPossibleScore(*it);
+		if(bound >= minScore) {
 			break;
 		}
 
+		discard(bound);
 		auto& m = match(it->i, it->j);
-		dlg_assert(m.candidate != candidates_.end());
-		m.candidate = candidates_.end();
+		dlg_assert(m.candidate());
+		m.setCandidate(0u);
 	}
 
 	if(it != candidates_.begin()) {
@@ -217,4 +1285,298 @@ void LazyMatrixMarch::prune(float minScore) {
 	return;
 }
 
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::trimBeam(const BatchMatcher& matcher) {
+	ExtZoneScoped;
+
+	// Dropping candidates might cut off all complete paths. Make sure
+	// there is one, the same way a warmStart() hint would.
+	if(bestMatch_ < 0.f) {
+		auto maxMatches = std::min(width(), height());
+		auto out = reuse(hintBuf_, maxMatches);
+		auto outID = maxMatches;
+		bestMatch_ = completeTop(matcher, out, outID);
+		hintBest_ = true;
+		hintPath_ = out.subspan(outID, maxMatches - outID);
+		prune(pruneLimit());
+		if(!beamFull()) {
+			return;
+		}
+	}
+
+	if(queue_ == Queue::heap) {
+		// Partition so that the most promising candidates come first,
+		// then restore the heap property on the kept ones.
+		std::nth_element(heap_.data, heap_.data + beamWidth_, heap_.data + heap_.size,
+			[](const BoundCand& a, const BoundCand& b) { return b < a; });
+		auto size = beamWidth_;
+		for(auto k = beamWidth_; k < heap_.size; ++k) {
+			auto cand = heap_.data[k];
+			auto& m = match(cand.cand.i, cand.cand.j);
+			if(!dropCandidate(m)) {
+				heap_.data[size++] = cand;
+			} else if(cand.bound >= pruneScore_) {
+				// otherwise it was pruned already
+				++numDropped_;
+				discard(cand.bound);
+			}
+		}
+
+		heap_.size = size;
+		for(auto pos = heap_.size; pos-- > 0u;) {
+			siftDownHeap(pos);
+		}
+
+		settleHeap();
+	} else if(queue_ == Queue::buckets) {
+		// Find the bucket containing the last candidate to keep, walking
+		// down from the top. Replaced candidates don't count.
+		auto kept = 0u;
+		auto last = topBucket_;
+		while(true) {
+			auto& bucket = buckets_[last];
+			auto valid = 0u;
+			for(auto k = 0u; k < bucket.size; ++k) {
+				auto& cand = bucket.data[k].cand;
+				auto& m = match(cand.i, cand.j);
+				valid += (m.candidate() && m.best() == cand.score);
+			}
+
+			if(kept + valid >= beamWidth_ || last == lowBucket_) {
+				break;
+			}
+
+			kept += valid;
+			--last;
+		}
+
+		trimBucket(buckets_[last], beamWidth_ - std::min(kept, beamWidth_));
+		for(auto b = lowBucket_; b < last; ++b) {
+			trimBucket(buckets_[b], 0u);
+		}
+
+		settleBuckets();
+	} else {
+		auto end = candidates_.begin();
+		std::advance(end, candidates_.size() - beamWidth_);
+		for(auto it = candidates_.begin(); it != end;) {
+			if(dropCandidate(match(it->i, it->j))) {
+				discard(maxPossibleScore(*it));
+				it = candidates_.erase(it);
+				++numDropped_;
+			} else {
+				++it;
+			}
+		}
+	}
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::trimBucket(CandArray& bucket, u32 keep) {
+	// Only keep valid candidates, the best ones first
+	auto size = 0u;
+	for(auto k = 0u; k < bucket.size; ++k) {
+		auto& cand = bucket.data[k].cand;
+		auto& m = match(cand.i, cand.j);
+		if(m.candidate() && m.best() == cand.score) {
+			bucket.data[size++] = bucket.data[k];
+		}
+	}
+
+	keep = std::min(keep, size);
+	std::nth_element(bucket.data, bucket.data + keep, bucket.data + size,
+		[](const BoundCand& a, const BoundCand& b) { return b < a; });
+
+	bucket.size = keep;
+	for(auto k = keep; k < size; ++k) {
+		auto cand = bucket.data[k];
+		if(dropCandidate(match(cand.cand.i, cand.cand.j))) {
+			--numCandidates_;
+			++numDropped_;
+			discard(cand.bound);
+		} else {
+			bucket.data[bucket.size++] = cand;
+		}
+	}
+
+	std::make_heap(bucket.data, bucket.data + bucket.size);
+}
+
+template<typename IndexT, typename CellT>
+bool LazyMatrixMarchCore<IndexT, CellT>::dropCandidate(CellT& m) {
+	// Fields are evaluated (or bounded, see deferEval) when their
+	// candidate is popped and expanded right after that, except when it
+	// was improved or pruned meanwhile. Otherwise, no other field
+	// depends on this one.
+	if(m.evaluated() || m.bounded()) {
+		return false;
+	}
+
+	m.setCandidate(0u);
+	m.resetBest();
+	return true;
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::clearBucket(CandArray& bucket) {
+	for(auto k = 0u; k < bucket.size; ++k) {
+		auto& cand = bucket.data[k].cand;
+		auto& m = match(cand.i, cand.j);
+		if(m.candidate() && m.best() == cand.score) {
+			m.setCandidate(0u);
+			--numCandidates_;
+			discard(bucket.data[k].bound);
+		}
+	}
+
+	bucket.size = 0u;
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::pushBucket(const BoundCand& cand) {
+	auto id = std::min(u32(cand.bound * bucketsPerUnit), u32(buckets_.size() - 1));
+	auto& bucket = buckets_[id];
+
+	if(bucket.size == bucket.capacity) {
+		growCandArray(bucket);
+	}
+
+	bucket.data[bucket.size] = cand;
+	++bucket.size;
+	std::push_heap(bucket.data, bucket.data + bucket.size);
+
+	lowBucket_ = std::min(lowBucket_, id);
+	topBucket_ = std::max(topBucket_, id);
+
+	// might have made a stale candidate at the top invalid
+	settleBuckets();
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::popBucket(CandArray& bucket) {
+	dlg_assert(bucket.size > 0u);
+	std::pop_heap(bucket.data, bucket.data + bucket.size);
+	--bucket.size;
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::settleBuckets() {
+	// Makes sure the top of buckets_[topBucket_] is a valid candidate, by
+	// discarding replaced or pruned candidates on the way.
+	while(numCandidates_ > 0u) {
+		auto& bucket = buckets_[topBucket_];
+		if(bucket.size == 0u) {
+			dlg_assert(topBucket_ > lowBucket_);
+			--topBucket_;
+			continue;
+		}
+
+		auto& top = bucket.data[0];
+		auto& m = match(top.cand.i, top.cand.j);
+		if(!m.candidate() || m.best() != top.cand.score) {
+			// was replaced
+			popBucket(bucket);
+			continue;
+		}
+
+		if(top.bound < pruneScore_) {
+			discard(top.bound);
+			m.setCandidate(0u);
+			--numCandidates_;
+			popBucket(bucket);
+			continue;
+		}
+
+		break;
+	}
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::growCandArray(CandArray& arr) {
+	// NOTE: the old data isn't freed, same as with the set nodes.
+	// Since we grow exponentially, this wastes at most as much
+	// memory as is currently in use.
+	auto newCap = std::max(2 * arr.capacity, 8u);
+	auto newData = alloc_.allocRawUndef<BoundCand>(newCap);
+	std::copy_n(arr.data, arr.size, newData);
+	arr.data = newData;
+	arr.capacity = newCap;
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::placeHeap(u32 pos, const BoundCand& cand) {
+	heap_.data[pos] = cand;
+	match(cand.cand.i, cand.cand.j).setCandidate(pos + 1);
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::siftUpHeap(u32 pos) {
+	auto cand = heap_.data[pos];
+	while(pos > 0u) {
+		auto parent = (pos - 1) / heapArity;
+		if(!(heap_.data[parent] < cand)) {
+			break;
+		}
+
+		placeHeap(pos, heap_.data[parent]);
+		pos = parent;
+	}
+
+	placeHeap(pos, cand);
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::siftDownHeap(u32 pos) {
+	auto cand = heap_.data[pos];
+	while(true) {
+		auto first = heapArity * pos + 1;
+		if(first >= heap_.size) {
+			break;
+		}
+
+		auto last = std::min(first + heapArity, heap_.size);
+		auto best = first;
+		for(auto c = first + 1; c < last; ++c) {
+			if(heap_.data[best] < heap_.data[c]) {
+				best = c;
+			}
+		}
+
+		if(!(cand < heap_.data[best])) {
+			break;
+		}
+
+		placeHeap(pos, heap_.data[best]);
+		pos = best;
+	}
+
+	placeHeap(pos, cand);
+}
+
+template<typename IndexT, typename CellT>
+void LazyMatrixMarchCore<IndexT, CellT>::settleHeap() {
+	// When the top was pruned, all other candidates were as well.
+	if(heap_.size == 0u || heap_.data[0].bound >= pruneScore_) {
+		return;
+	}
+
+	discard(heap_.data[0].bound);
+
+	for(auto k = 0u; k < heap_.size; ++k) {
+		auto& cand = heap_.data[k].cand;
+		match(cand.i, cand.j).setCandidate(0u);
+	}
+
+	heap_.size = 0u;
+}
+
+template struct LazyMatrixMarchCore<u16>;
+template struct LazyMatrixMarchCore<u32>;
+template struct LazyMatrixMarchCore<u16, LazyMatrixMarchBase::CompactMatch>;
+
+template struct LazyMatrixMarchT<LazyMatrixMarchBase::Matcher>;
+template struct LazyMatrixMarchT<LazyMatrixMarchBase::Matcher, u32>;
+template struct LazyMatrixMarchT<LazyMatrixMarchBase::Matcher,
+	u16, LazyMatrixMarchBase::CompactMatch>;
+
 } // namespace vil
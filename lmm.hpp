@@ -1,8 +1,14 @@
 #pragma once
 
 #include <linalloc.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <functional>
+#include <type_traits>
 #include <utility>
+#include <memory>
+#include <limits>
 #include <set>
 
 namespace vil {
@@ -21,9 +27,9 @@ namespace vil {
 // of mostly similar sequences, it will be ~O(n).
 // The idea (and implementation) of the algorithm can be described
 // as a best-path finding through the lazily evaluated matching matrix.
-// Memory consumption is currently always O(n^2) since this was never
-// a big problem. It could be reduced, being ~O(n) for the well-matching
-// cases as well.
+// With the default dense storage, memory consumption is always O(n^2).
+// Storage::paged only allocates the parts of the matrix the search
+// actually visits, making it ~O(n) for the well-matching cases as well.
 //
 // In vil, we need this for command hierachy matching, associating
 // commands between different frames and submissions.
@@ -36,7 +42,18 @@ namespace vil {
 // But if you have costly comparisons (e.g. for hierachical matching as we
 // do with command buffers), this implementation can be an order of
 // magnitude faster, especially when there's a strong correlation.
-struct LazyMatrixMarch {
+//
+// A cell of the matching matrix, see LmmBatchMatcher.
+struct LmmCell {
+	u32 i;
+	u32 j;
+};
+
+// LazyMatrixMarchBase holds the types and parameters shared by all
+// variants, LazyMatrixMarchCore everything that does not depend on the
+// matcher. Use LazyMatrixMarchT to get a matcher that can be inlined
+// into the search or the type-erased LazyMatrixMarch.
+struct LazyMatrixMarchBase {
 	// Describes a match between the ith sequence item in the first sequence
 	// with the jth sequence item in the second sequence, with a match
 	// equal to 'matchVal'.
@@ -50,121 +67,569 @@ struct LazyMatrixMarch {
 		// accumulated matching value of the best path
 		float totalMatch;
 		// All the matches found on the best path
-		// Span lifetime depends on LinAllocator this is constructed with
+		// Span lifetime depends on LinAllocator this is constructed with.
+		// Only valid until the LazyMatrixMarch is reset().
 		span<ResultMatch> matches;
+		// Whether run() stopped early due to its Budget. The path is
+		// valid but not necessarily the best one then.
+		bool approximate {};
+		// Upper bound for how much better the best path might be, i.e.
+		// its totalMatch is at most totalMatch + gap. Zero when this one
+		// is known to be the best. Can be positive when candidates were
+		// discarded due to Params::branchThreshold, maxSuboptimality or
+		// beamWidth, or when run() stopped early.
+		float gap {};
 	};
 
-	struct HeapCand {
-		u16 i;
-		u16 j;
-		float score;
+	// Limits for run(). Zero (or the default time_point) means no limit.
+	// They are checked between steps, so they can be exceeded by one
+	// step, i.e. up to Params::batchSize evaluations.
+	// Not supported for Storage::linear.
+	struct Budget {
+		u64 maxEvals {};
+		u64 maxSteps {};
+		std::chrono::steady_clock::time_point deadline {};
 	};
 
-	struct HeapCandCompare {
-		LazyMatrixMarch& parent;
+	// Reading the clock is not free, the deadline is only checked
+	// every deadlineInterval steps.
+	static constexpr u32 deadlineInterval = 64u;
 
-		bool operator()(const HeapCand& a, const HeapCand& b) const {
-			auto scA = parent.maxPossibleScore(a.score, a.i, a.j);
-			auto scB = parent.maxPossibleScore(b.score, b.i, b.j);
+	// Single-object deallocations (i.e. the nodes of QSet) are put into
+	// a free-list and returned by the next single-object allocation.
+	// The free-list is shared between all rebound copies, so only one
+	// object type may be allocated through them.
+	template<typename T>
+	struct MyAlloc : LinearUnscopedAllocator<T> {
+		using typename LinearUnscopedAllocator<T>::is_always_equal;
+		using typename LinearUnscopedAllocator<T>::value_type;
 
-			if(scA < scB) {
-				return true;
-			} else if(scB < scA) {
-				return false;
-			}
+		void** freeList_;
 
-			if(a.score < b.score) {
-				return true;
-			} else if(b.score < a.score) {
-				return false;
-			}
+		MyAlloc(LinAllocator& alloc, void*& freeList) noexcept :
+			LinearUnscopedAllocator<T>(alloc), freeList_(&freeList) {}
+
+		template<typename O>
+		MyAlloc(const MyAlloc<O>& rhs) noexcept :
+			LinearUnscopedAllocator<T>(rhs), freeList_(rhs.freeList_) {}
 
-			if(a.i < b.i) {
-				return true;
-			} else if(b.i < a.i) {
-				return false;
+		T* allocate(size_t n) {
+			if(n == 1u && *freeList_) {
+				auto* ptr = *freeList_;
+				std::memcpy(freeList_, ptr, sizeof(void*));
+				return static_cast<T*>(ptr);
 			}
 
-			return a.j < b.j;
+			return LinearUnscopedAllocator<T>::allocate(n);
 		}
-	};
-
-	template<typename T>
-	struct MyAlloc : LinearUnscopedAllocator<T> {
-		using typename LinearUnscopedAllocator<T>::is_always_equal;
-		using typename LinearUnscopedAllocator<T>::value_type;
-		using LinearUnscopedAllocator<T>::LinearUnscopedAllocator;
-		using LinearUnscopedAllocator<T>::allocate;
 
-		void deallocate(T*, size_t) const noexcept {
-			// TODO: use free-list
-			// dlg_error(":(");
+		void deallocate(T* ptr, size_t n) const noexcept {
+			static_assert(sizeof(T) >= sizeof(void*));
+			if(n == 1u) {
+				std::memcpy(static_cast<void*>(ptr), freeList_, sizeof(void*));
+				*freeList_ = ptr;
+			}
 		}
 	};
 
-	using QSet = std::set<HeapCand, HeapCandCompare, MyAlloc<HeapCand>>;
-
+	// A cell of the lazily evaluated matching matrix.
 	struct EvalMatch {
+		// See CompactMatch
+		static constexpr bool stamped = true;
+
 		// The result of the matcher function at this position.
-		// Lazily evaluated, -1.f if it never was called
-		float eval {-1.f};
+		// Lazily evaluated, -1.f if it never was called. Values below
+		// that store the result of Params::matchBound as -2.f - bound.
+		float eval_ {-1.f};
 		// The best path found so far to this position
 		// -1.f when we never had a path here
-		float best {-1.f};
-		// current candidate, if any.
-		// with this we can make sure there is never more than one
-		// candidate per field
-		QSet::const_iterator candidate; // candidates_.end() when there is none
+		float best_ {-1.f};
+		// Whether there currently is a candidate for this field, 0 if not.
+		// With this we can make sure there is never more than one
+		// candidate per field. Since the candidate's score is always
+		// equal to 'best', we can look it up in the set when needed.
+		// For Queue::heap, this is the position in the heap plus one.
+		u32 candidate_ {};
+		// Cells are only valid if this matches the generation of the
+		// LazyMatrixMarch they belong to. Otherwise they are treated as
+		// untouched. Since the first generation is 1, zero-initialized
+		// memory is a valid matrix without ever writing to it.
+		u32 gen {};
+
+		bool evaluated() const { return eval_ >= 0.f; }
+		// Negative when not evaluated
+		float eval() const { return eval_; }
+		void setEval(float val) { eval_ = val; }
+		// See Params::matchBound. Only set while not evaluated.
+		bool bounded() const { return eval_ <= -2.f; }
+		float bound() const { return -2.f - eval_; }
+		void setBound(float bound) { eval_ = -2.f - bound; }
+		float best() const { return best_; }
+		void setBest(float score) { best_ = score; }
+		void resetBest() { best_ = -1.f; }
+		u32 candidate() const { return candidate_; }
+		void setCandidate(u32 cand) { candidate_ = cand; }
 	};
 
-	// The function evaluating the match between the ith element in the
-	// first sequence with the jth element in the second sequence.
-	// Note how the LazyMatrixMarch algorithm itself never sees the sequences
-	// itself, does not care about their types of properties.
-	// Expected to return a matching value in range [0, 1] where 0
-	// means no match and a value >0 means there's a match, returning
-	// it's weight/value/importance/quality.
-	// Guaranteed to be called at most once per run for each (i, j)
-	// combinations so don't bother caching results.
+	// Alternative cell layout with 8 instead of 16 bytes, halving the
+	// memory of the matrix and fitting twice as many cells in a cache line.
+	// Match values are quantized to multiples of 1 / evalScale, so the
+	// result might differ slightly from the one with EvalMatch. All scores
+	// are sums of such values then and since they never exceed 64K
+	// (only u16 indices are supported), they are represented exactly
+	// as float, i.e. the search itself is unaffected.
+	// All-zero is the initial state, there is no generation. Only
+	// zero-initialized memory is a valid matrix.
+	struct CompactMatch {
+		static constexpr bool stamped = false;
+		static constexpr u32 evalScale = 256u;
+
+		// 0 if not evaluated, 1 + eval * evalScale otherwise.
+		// From boundBits on, the result of Params::matchBound, rounded
+		// up to multiples of 2 / evalScale.
+		u64 evalBits_ : 9 {};
+		// 0 if there never was a path here, 1 + best * evalScale otherwise
+		u64 bestBits_ : 25 {};
+		// See EvalMatch::candidate_
+		u64 candidateBits_ : 30 {};
+
+		static constexpr u32 boundBits = evalScale + 2u;
+
+		bool evaluated() const { return evalBits_ != 0u && evalBits_ < boundBits; }
+		float eval() const {
+			return evaluated() ? float(evalBits_ - 1) / evalScale : -1.f;
+		}
+		void setEval(float val) {
+			dlg_assert(val >= 0.f && val <= 1.f);
+			evalBits_ = 1u + u32(val * evalScale + 0.5f);
+		}
+
+		float best() const {
+			return bestBits_ ? float(bestBits_ - 1) / evalScale : -1.f;
+		}
+		void setBest(float score) {
+			auto bits = score * evalScale;
+			dlg_assert(bits >= 0.f && bits == float(u32(bits)));
+			bestBits_ = 1u + u32(bits);
+		}
+		void resetBest() { bestBits_ = 0u; }
+
+		bool bounded() const { return evalBits_ >= boundBits; }
+		float bound() const { return float(evalBits_ - boundBits) * 2.f / evalScale; }
+		void setBound(float bound) {
+			dlg_assert(bound >= 0.f);
+			evalBits_ = boundBits + u32(std::ceil(std::min(bound, 1.f) * (evalScale / 2)));
+		}
+
+		u32 candidate() const { return u32(candidateBits_); }
+		void setCandidate(u32 cand) {
+			dlg_assert(cand < (1u << 30));
+			candidateBits_ = cand;
+		}
+	};
+
+	static_assert(sizeof(CompactMatch) == 8u);
+
+	// The type-erased matcher used by LazyMatrixMarch, see LmmMatcher.
 	using Matcher = std::function<float(u32 i, u32 j)>;
+	// Type-erased batch matcher, see LmmBatchMatcher.
+	using BatchMatcher = std::function<void(span<const LmmCell> cells, span<float> values)>;
+	// Receives the matches of the best path one by one, see
+	// LazyMatrixMarchT::run(const MatchVisitor&).
+	using MatchVisitor = std::function<void(const ResultMatch& match)>;
+
+	// How the lazily evaluated matching matrix is stored.
+	enum class Storage {
+		// A single allocation of width * height cells.
+		// Fastest access but always needs O(width * height) memory.
+		dense,
+		// The matrix is split into tiles of tileSize * tileSize cells that
+		// are only allocated when a cell inside them is first accessed.
+		// Memory consumption then tracks the cells the search actually
+		// visits, at the cost of an additional indirection per access.
+		paged,
+		// No matrix is stored at all. run() finds the best path via
+		// divide-and-conquer instead: it computes the scores through the
+		// middle row of the matrix with a row-by-row pass from both ends,
+		// splits the problem where the best path crosses that row and
+		// recurses into both halves. All passes skip the cells that can't
+		// be part of a path at least as good as a known one.
+		// Memory is O(width + height), but the matcher is called multiple
+		// times for the same cell, see numExtraEvals(). The result is
+		// always optimal, i.e. branchThreshold is ignored.
+		// Only run() can be used in this mode, not step().
+		linear,
+	};
+
+	// The data structure used for the candidate queue.
+	enum class Queue {
+		// A std::set, ordered by HeapCandCompare.
+		set,
+		// Since maxPossibleScore is bounded by min(width, height) and never
+		// increases along a path, we can store candidates in buckets of
+		// quantized maxPossibleScore. Only inside a bucket, candidates
+		// need to be sorted. Replaced candidates are not removed but
+		// discarded lazily once they reach the top of their bucket.
+		// Pruning mostly drops whole buckets.
+		// All candidates with a maxPossibleScore in
+		// [b / bucketsPerUnit, (b + 1) / bucketsPerUnit) are stored in
+		// bucket b, as binary max-heap.
+		buckets,
+		// Array-based heapArity-ary max-heap. The fields know the heap
+		// position of their candidate, so improving a candidate is an
+		// in-place increase-key instead of an erase and insert.
+		// Pruned candidates are only discarded when they reach the top.
+		heap,
+	};
+
+	static constexpr u32 bucketsPerUnit = 4u;
+	static constexpr u32 heapArity = 4u;
+
+	static constexpr u32 tileShift = 5u;
+	static constexpr u32 tileSize = 1u << tileShift;
+	static constexpr u32 tileMask = tileSize - 1u;
+
+	struct Params {
+		// Cells with a match value >= branchThreshold won't branch out
+		// to their right and bottom neighbors. Only values >= 1.f are
+		// guaranteed to give the optimal result, see step(). How much
+		// is lost otherwise is only known afterwards, see Result::gap.
+		float branchThreshold {0.95f};
+		Storage storage {Storage::dense};
+		Queue queue {Queue::set};
+		// Maximum number of candidates expanded per step() when
+		// using a batch matcher, see LmmBatchMatcher.
+		u32 batchSize {16u};
+		// Optional. Returns whether the ith element of the first sequence
+		// is identical to the jth element of the second one, i.e. whether
+		// the matcher would return 1.f for them. When given, the common
+		// prefix and suffix of identical elements are matched in a linear
+		// scan upfront and the matrix only covers the elements between
+		// them. Comparing precomputed per-element hashes fits well here.
+		std::function<bool(u32 i, u32 j)> identical {};
+		// Optional beam width. When there are more than twice as many
+		// candidates, all but the beamWidth most promising ones (by
+		// maxPossibleScore) are dropped. Bounds the memory and per-step
+		// cost of the queue but the result is no longer guaranteed to be
+		// optimal, see numDropped(). Candidates for fields that were
+		// already expanded with a lower score are never dropped, the
+		// fields after them would be inconsistent otherwise.
+		// Not used for Storage::linear.
+		u32 beamWidth {};
+		// Optional upper bounds for the match values of single elements:
+		// the ith element of the first sequence never matches any element
+		// of the second one with more than maxMatchI(i), same for the jth
+		// element of the second sequence and maxMatchJ(j). Missing ones
+		// are assumed to be 1.f. maxPossibleScore then uses their suffix
+		// sums instead of the number of remaining elements. For fuzzy
+		// matches, that is a much tighter bound and prunes many more
+		// cells. Bounds that are too low give wrong results.
+		// Called once per element on construction and reset().
+		std::function<float(u32 i)> maxMatchI {};
+		std::function<float(u32 j)> maxMatchJ {};
+		// Maximum relative suboptimality of the result, in [0, 1).
+		// Candidates are pruned once their maxPossibleScore is less than
+		// 1 / (1 - maxSuboptimality) times the score of the best known
+		// path, instead of the score itself. The result then satisfies
+		// totalMatch >= (1 - maxSuboptimality) * optimal, as long as
+		// branchThreshold >= 1.f and no beamWidth is used. Unlike with
+		// branchThreshold, the loss is bounded upfront. Every improvement
+		// of the best path is traced back right away then.
+		// Not used for Storage::linear.
+		float maxSuboptimality {};
+		// Optional. A cheap upper bound for the match value of the ith
+		// element of the first sequence and the jth element of the second
+		// one, e.g. from comparing types or flags before the expensive
+		// comparison the matcher does. It is called when the cell is
+		// expanded the first time and stored in it. The matcher is only
+		// called once a match there could lead to a path better than the
+		// best known one, so many cells are never evaluated at all, see
+		// numBounds(). Cells with a bound of 0.f never are. Cells that
+		// were only bounded always branch out, see branchThreshold.
+		// Bounds that are too low give wrong results.
+		// Not used for Storage::linear.
+		std::function<float(u32 i, u32 j)> matchBound {};
+	};
+};
+
+// The matcher-independent state and search machinery.
+// IndexT is the type used to store the coordinates of candidates. u16
+// keeps candidates small but limits the sequences to 64K elements,
+// u32 lifts that limit.
+// CellT is the layout of the matrix cells, EvalMatch or CompactMatch.
+template<typename IndexT, typename CellT = LazyMatrixMarchBase::EvalMatch>
+struct LazyMatrixMarchCore : LazyMatrixMarchBase {
+	static_assert(std::is_same_v<IndexT, u16> || std::is_same_v<IndexT, u32>);
+	static_assert(std::is_same_v<CellT, EvalMatch> ||
+		(std::is_same_v<CellT, CompactMatch> && std::is_same_v<IndexT, u16>));
+	static constexpr u32 maxIndex = std::numeric_limits<IndexT>::max();
+
+	struct HeapCand {
+		IndexT i;
+		IndexT j;
+		float score;
+	};
+
+	// Order of candidates, given their maxPossibleScore values.
+	static bool candLess(float scA, const HeapCand& a,
+			float scB, const HeapCand& b) {
+		if(scA < scB) {
+			return true;
+		} else if(scB < scA) {
+			return false;
+		}
+
+		if(a.score < b.score) {
+			return true;
+		} else if(b.score < a.score) {
+			return false;
+		}
+
+		if(a.i < b.i) {
+			return true;
+		} else if(b.i < a.i) {
+			return false;
+		}
+
+		return a.j < b.j;
+	}
+
+	struct HeapCandCompare {
+		LazyMatrixMarchCore& parent;
+
+		bool operator()(const HeapCand& a, const HeapCand& b) const {
+			auto scA = parent.maxPossibleScore(a.score, a.i, a.j);
+			auto scB = parent.maxPossibleScore(b.score, b.i, b.j);
+			return candLess(scA, a, scB, b);
+		}
+	};
+
+	using QSet = std::set<HeapCand, HeapCandCompare, MyAlloc<HeapCand>>;
+
+	// Candidate with its maxPossibleScore, so the bound doesn't have to
+	// be recomputed on every comparison.
+	struct BoundCand {
+		float bound;
+		HeapCand cand;
+
+		bool operator<(const BoundCand& rhs) const {
+			return candLess(bound, cand, rhs.bound, rhs.cand);
+		}
+	};
+
+	// Growable array of candidates, used as heap storage for
+	// Queue::buckets and Queue::heap.
+	struct CandArray {
+		BoundCand* data;
+		u32 size;
+		u32 capacity;
+	};
 
 	// width: length of the first sequence
 	// height: length of the second sequence
 	// alloc: an allocator guaranteed to outlive this
-	// matcher: the matching functions holding information about the sequences
-	LazyMatrixMarch(u32 width, u32 height, LinAllocator& alloc,
-		Matcher matcher, float branchThreshold = 0.95);
+	LazyMatrixMarchCore(u32 width, u32 height, LinAllocator& alloc,
+		const Params& params);
 
-	// Runs the algorithm to completion (can also be called if 'step' was
-	// called before) and returns the best path and its matches.
-	Result run();
-
-	// Returns false if there's nothing to do anymore.
-	bool step();
+	LazyMatrixMarchCore(const LazyMatrixMarchCore&) = delete;
+	LazyMatrixMarchCore& operator=(const LazyMatrixMarchCore&) = delete;
 
 	// inspection
 	HeapCand peekCandidate() const;
+	// maxPossibleScore of peekCandidate()
+	float peekBound() const {
+		auto cand = peekCandidate();
+		return maxPossibleScore(cand.score, cand.i, cand.j);
+	}
+	// Score of the best complete path found so far, -1.f if there is none
+	float bestMatch() const { return bestMatch_; }
+	// Highest maxPossibleScore of a candidate that was discarded without
+	// being expanded and might have been better than bestMatch(), see
+	// Result::gap. -1.f if there is none.
+	float discardBound() const { return discardBound_; }
+	// Only used for Queue::set
 	const auto& candidates() const { return candidates_; }
-	bool empty() const { return candidates_.empty(); }
-	const EvalMatch& matchData(u32 i, u32 j) const {
-		return matchMatrix_[width() * j + i];
+	bool empty() const { return numCandidates() == 0u; }
+	// Writes the matches of the best known path to cell (i, j),
+	// excluding the cell itself, backwards into out, ending before
+	// outID. outID is then the index of the first written match.
+	// Returns false if the path can't be traced back, only possible
+	// while the search isn't finished, see finishEarly.
+	// The path to peekCandidate() can always be traced back.
+	bool traceBack(u32 i, u32 j, span<ResultMatch> out, u32& outID);
+	u32 numCandidates() const {
+		switch(queue_) {
+			case Queue::set: return u32(candidates_.size());
+			case Queue::buckets: return numCandidates_;
+			// NOTE: might include pruned candidates
+			case Queue::heap: return heap_.size;
+		}
+
+		return 0u;
+	}
+	// Returns a cell without allocating it. For paged storage, cells
+	// in tiles that were never touched are returned in their initial state.
+	const CellT& matchData(u32 i, u32 j) const {
+		const CellT* m;
+		if(storage_ == Storage::dense) {
+			m = &matchMatrix_[std::size_t(width()) * j + i];
+		} else if(storage_ == Storage::linear) {
+			return untouched_;
+		} else {
+			auto tile = tiles_[std::size_t(tilesX_) * (j >> tileShift) + (i >> tileShift)];
+			if(!tile) {
+				return untouched_;
+			}
+
+			m = &tile[((j & tileMask) << tileShift) + (i & tileMask)];
+		}
+
+		if constexpr(CellT::stamped) {
+			return m->gen == gen_ ? *m : untouched_;
+		} else {
+			return *m;
+		}
 	}
 
+	// Dimensions of the matrix. With Params::identical, the matrix only
+	// covers the elements between the trimmed prefix and suffix, shifted
+	// by prefix(). All coordinates of the inspection functions are
+	// relative to the matrix. Results are in sequence coordinates.
 	u32 width() const { return width_; }
 	u32 height() const { return height_; }
+	u32 prefix() const { return prefix_; }
+	u32 suffix() const { return suffix_; }
+	Storage storage() const { return storage_; }
+	Queue queue() const { return queue_; }
 
 	// debug information
-	u32 numEvals() const { return numEvals_; }
-	u32 numSteps() const { return numSteps_; }
+	u64 numEvals() const { return numEvals_; }
+	u64 numSteps() const { return numSteps_; }
+	// Number of Params::matchBound calls
+	u64 numBounds() const { return numBounds_; }
+	// Storage::linear: the matcher calls that were spent on cells that
+	// might have been evaluated before. Included in numEvals().
+	u64 numExtraEvals() const { return numExtraEvals_; }
+	u32 numTiles() const { return numTiles_; }
+	// Number of candidates dropped due to Params::beamWidth
+	u64 numDropped() const { return numDropped_; }
+
+protected:
+	// Adds the successors of the given, just popped, candidate.
+	// The field must have been evaluated already, unless deferEval
+	// returned true for it.
+	void expand(const HeapCand& cand, const CellT& m);
+	// For a just popped candidate on a field that wasn't evaluated yet:
+	// returns whether the field can be expanded without calling the
+	// matcher, i.e. when a match there can't lead to a path that beats
+	// pruneLimit(), judging by Params::matchBound.
+	bool deferEval(const HeapCand& cand, CellT& m);
+	// Traces back the best path.
+	Result gatherResult();
+	// Like gatherResult but passes the matches to 'visitor' instead,
+	// last one first. The returned result has no matches.
+	Result traceResult(const MatchVisitor& visitor);
+	// Calls onMatch(ResultMatch) for the matches of the best known path
+	// to cell (i, j), last one first. See traceBack.
+	template<typename F> bool walkBack(u32 i, u32 j, F&& onMatch);
+	// Result for a run() that ran out of budget: the best complete path
+	// if there is one. Otherwise, the path to the most promising
+	// candidate, completed greedily.
+	Result finishEarly(const BatchMatcher& matcher);
+	// Completes the path to the most promising candidate greedily and
+	// writes its matches backwards into out, like traceBack.
+	// Returns the score of the complete path.
+	float completeTop(const BatchMatcher& matcher, span<ResultMatch> out, u32& outID);
+	// Adds the trimmed prefix and suffix to a result for the matrix.
+	Result addTrimmed(const Result& middle);
+	// Implementation of run() for Storage::linear.
+	Result runLinear(const BatchMatcher& matcher);
+	// Implementation of warmStart()
+	void seedHint(span<const ResultMatch> hint, const BatchMatcher& matcher);
+	// Implementation of reset()
+	void resetState(u32 width, u32 height);
+	// Evaluates the bounds of Params::maxMatchI and maxMatchJ.
+	void initBounds();
+	// Sets up the matrix and queue for a width x height problem,
+	// reusing their previous allocations when possible.
+	void init(u32 width, u32 height);
+	// Makes all cells untouched again, moving tiles to freeTiles_.
+	void clearCells();
+	// Returns the first n elements of buf, growing it if needed.
+	// Used for everything that is part of a result.
+	span<ResultMatch> reuse(span<ResultMatch>& buf, std::size_t n);
 
-private:
 	void addCandidate(float score, u32 i, u32 j, u32 addI, u32 addJ);
+	void insertCandidate(const HeapCand& cand, float bound);
 
 	HeapCand popCandidate();
 	void prune(float minScore);
-	EvalMatch& match(u32 i, u32 j) {
-		return matchMatrix_[width() * j + i];
+	// Candidates with a lower maxPossibleScore are pruned, see
+	// Params::maxSuboptimality.
+	float pruneLimit() const {
+		return bestMatch_ > 0.f ? bestMatch_ * pruneScale_ : bestMatch_;
+	}
+	// Called for candidates that are discarded without being expanded
+	void discard(float bound) {
+		discardBound_ = std::max(discardBound_, bound);
 	}
+	// The gap of a result with the given score, see Result::gap
+	float gapTo(float score) const;
+	// Stores the path to bestRes_ as hintPath_. Needed when
+	// Params::maxSuboptimality drops improvements to its cells.
+	void pinBest();
+	// See Params::beamWidth. Called after every step
+	bool beamFull() const {
+		return beamWidth_ && numCandidates() > 2 * beamWidth_;
+	}
+	void trimBeam(const BatchMatcher& matcher);
+	// Drops all candidates in the bucket.
+	void clearBucket(CandArray& bucket);
+	// Drops all but the best 'keep' candidates in the bucket, see
+	// dropCandidate. Also discards the replaced ones.
+	void trimBucket(CandArray& bucket, u32 keep);
+	// Whether the candidate of the field can be dropped by trimBeam.
+	// If so, the field is made untouched again so that other paths
+	// can still reach it.
+	bool dropCandidate(CellT& m);
+
+	// Queue::buckets
+	void pushBucket(const BoundCand& cand);
+	void popBucket(CandArray& bucket);
+	void settleBuckets();
+	void growCandArray(CandArray& arr);
+
+	// Queue::heap
+	void placeHeap(u32 pos, const BoundCand& cand);
+	void siftUpHeap(u32 pos);
+	void siftDownHeap(u32 pos);
+	void settleHeap();
+	CellT& match(u32 i, u32 j) {
+		CellT* m;
+		if(storage_ == Storage::dense) VIL_LIKELY {
+			m = &matchMatrix_[std::size_t(width()) * j + i];
+		} else {
+			auto& tile = tiles_[std::size_t(tilesX_) * (j >> tileShift) + (i >> tileShift)];
+			if(!tile) VIL_UNLIKELY {
+				tile = allocTile();
+			}
+
+			m = &tile[((j & tileMask) << tileShift) + (i & tileMask)];
+		}
+
+		// first access in this generation
+		if constexpr(CellT::stamped) {
+			if(m->gen != gen_) {
+				*m = {};
+				m->gen = gen_;
+			}
+		}
+
+		return *m;
+	}
+
+	CellT* allocTile();
+	template<typename T> span<T> allocZeroed(std::size_t n);
 
 	// util
 	float maxPossibleScore(float score, u32 i, u32 j) const;
@@ -172,26 +637,429 @@ private:
 		return maxPossibleScore(c.score, c.i, c.j);
 	}
 
-private:
+protected:
 	LinAllocator& alloc_;
 	u32 width_;
 	u32 height_;
-	Matcher matcher_;
-	// lazily evaluated matrix
-	// NOTE: need unique span since the iterator type might be
-	// non-trivially-destructible (e.g. the case for stdc++ debug mode)
-	UniqueSpan<EvalMatch> matchMatrix_;
+	// See Params::identical
+	u32 prefix_ {};
+	u32 suffix_ {};
+	Storage storage_;
+	Queue queue_;
+	// See Params::identical
+	std::function<bool(u32 i, u32 j)> identical_;
+	// See Params::matchBound
+	std::function<float(u32 i, u32 j)> matchBound_;
+	// lazily evaluated matrix, for Storage::dense.
+	// Might be larger than width_ * height_ after a reset().
+	span<CellT> matchMatrix_;
+	// Storage::paged: row-major table of tiles, null until first touched.
+	// Cells inside a tile are row-major as well.
+	span<CellT*> tiles_;
+	u32 tilesX_ {};
+	u32 numTiles_ {};
+	// Tiles of previous runs, see reset(). Linked via a pointer
+	// stored in their first bytes.
+	CellT* freeTiles_ {};
+	// See EvalMatch::gen
+	u32 gen_ {1u};
+
+	// Large zero-initialized allocations are done via calloc instead
+	// of the LinAllocator, see allocZeroed.
+	struct FreeDeleter {
+		void operator()(void* ptr) const { std::free(ptr); }
+	};
+	std::unique_ptr<std::byte, FreeDeleter> zeroedBlock_;
 	float bestMatch_ {-1.f};
 	std::pair<u32, u32> bestRes_ {};
+	// See warmStart(). Whether bestMatch_ is the score of hintPath_,
+	// i.e. no better path was found yet.
+	bool hintBest_ {};
+	span<ResultMatch> hintPath_;
 	float branchThreshold_;
+	u32 beamWidth_;
+	// 1 / (1 - Params::maxSuboptimality)
+	float pruneScale_;
+	// See discardBound()
+	float discardBound_ {-1.f};
+
+	// See Params::maxMatchI
+	std::function<float(u32 i)> maxMatchI_;
+	std::function<float(u32 j)> maxMatchJ_;
+	// The bounds of the elements in the matrix and their suffix sums,
+	// restI_[i] is the sum of boundsI_[i...]. Empty without bounds.
+	span<float> boundsI_;
+	span<float> boundsJ_;
+	span<float> restI_;
+	span<float> restJ_;
+	// Storage for the spans above, reused by reset()
+	span<float> boundBuf_;
+
+	// Reused for the results of all runs, see reuse()
+	span<ResultMatch> hintBuf_;
+	span<ResultMatch> pathBuf_;
+	span<ResultMatch> trimmedBuf_;
 
 	// debug functionality
-	u32 numEvals_ {};
-	u32 numSteps_ {};
+	u64 numEvals_ {};
+	u64 numSteps_ {};
+	u64 numExtraEvals_ {};
+	u64 numDropped_ {};
+	u64 numBounds_ {};
 
+	// See MyAlloc
+	void* nodeFreeList_ {};
 	QSet candidates_;
+
+	// Queue::buckets
+	span<CandArray> buckets_;
+	// There are no candidates outside of [lowBucket_, topBucket_]
+	u32 lowBucket_ {};
+	u32 topBucket_ {};
+	u32 numCandidates_ {};
+
+	// Queue::heap
+	CandArray heap_ {};
+
+	// Queue::buckets, Queue::heap.
+	// All candidates with a lower maxPossibleScore were pruned
+	float pruneScore_ {-1.f};
+
+	// returned by matchData for untouched cells
+	CellT untouched_;
+};
+
+// The function evaluating the match between the ith element in the
+// first sequence with the jth element in the second sequence.
+// Note how the LazyMatrixMarch algorithm itself never sees the sequences
+// itself, does not care about their types of properties.
+// Expected to return a matching value in range [0, 1] where 0
+// means no match and a value >0 means there's a match, returning
+// it's weight/value/importance/quality.
+// Guaranteed to be called at most once per run for each (i, j)
+// combinations so don't bother caching results. The only exception
+// is Storage::linear.
+template<typename F>
+concept LmmCellMatcher = std::is_invocable_r_v<float, F&, u32, u32>;
+
+// Alternatively, a matcher can evaluate multiple cells at once, writing
+// the match value of cells[k] into values[k]. This allows sharing setup
+// between the evaluations or prefetching the element data.
+// LazyMatrixMarchT will then collect up to Params::batchSize candidates
+// per step() and evaluate all of them with one call.
+// The same guarantees as for a single-cell matcher apply.
+template<typename F>
+concept LmmBatchMatcher = requires(F& f, span<const LmmCell> cells, span<float> values) {
+	f(cells, values);
 };
 
+template<typename F>
+concept LmmMatcher = LmmCellMatcher<F> || LmmBatchMatcher<F>;
+
+// The matcher is a template parameter so that it can be inlined into
+// step(), which matters for cheap matchers.
+// Use IndexT = u32 for sequences with more than 64K elements and
+// CellT = CompactMatch for less memory, see LazyMatrixMarchCore.
+template<LmmMatcher MatcherT, typename IndexT = u16,
+	typename CellT = LazyMatrixMarchBase::EvalMatch>
+struct LazyMatrixMarchT : LazyMatrixMarchCore<IndexT, CellT> {
+	using Core = LazyMatrixMarchCore<IndexT, CellT>;
+	using typename Core::HeapCand;
+	using typename Core::Params;
+	using typename Core::Result;
+	using typename Core::Storage;
+
+	static constexpr bool batched = LmmBatchMatcher<MatcherT>;
+
+	// matcher: the matching functions holding information about the sequences
+	LazyMatrixMarchT(u32 width, u32 height, LinAllocator& alloc,
+			MatcherT matcher, float branchThreshold = 0.95) :
+		LazyMatrixMarchT(width, height, alloc, std::move(matcher),
+			Params{.branchThreshold = branchThreshold}) {
+	}
+
+	LazyMatrixMarchT(u32 width, u32 height, LinAllocator& alloc,
+			MatcherT matcher, const Params& params) :
+		Core(width, height, alloc, params),
+		matcher_(std::move(matcher)) {
+		if constexpr(std::is_constructible_v<bool, const MatcherT&>) {
+			dlg_assert(matcher_);
+		}
+
+		if constexpr(batched) {
+			dlg_assert(params.batchSize > 0u);
+			batchCands_ = alloc.alloc<HeapCand>(params.batchSize);
+			batchCells_ = alloc.alloc<LmmCell>(params.batchSize);
+			batchValues_ = alloc.alloc<float>(params.batchSize);
+		}
+	}
+
+	// Runs the algorithm to completion (can also be called if 'step' was
+	// called before) and returns the best path and its matches.
+	Result run() {
+		ExtZoneScoped;
+
+		if(this->storage() == Storage::linear) {
+			return this->runLinear(batchMatcher());
+		}
+
+		while(step()) /*noop*/;
+		return this->gatherResult();
+	}
+
+	// Like run() but streams the matches of the best path to 'visitor',
+	// last one first, instead of gathering them in a buffer large
+	// enough for min(width, height) matches. The returned result has
+	// no matches. Storage::linear still needs the buffer internally.
+	Result run(const typename Core::MatchVisitor& visitor) {
+		ExtZoneScoped;
+
+		if(this->storage() == Storage::linear) {
+			auto res = this->runLinear(batchMatcher());
+			for(auto k = res.matches.size(); k-- > 0u;) {
+				visitor(res.matches[k]);
+			}
+
+			res.matches = {};
+			return res;
+		}
+
+		while(step()) /*noop*/;
+		return this->traceResult(visitor);
+	}
+
+	// Like run() but the matches are allocated from 'out', exactly as
+	// many as the best path has. The path is traced back twice for
+	// that, the first time only counting them.
+	// Unlike with run(), the matches stay valid after reset().
+	Result run(LinAllocator& out) {
+		ExtZoneScoped;
+
+		using ResultMatch = typename Core::ResultMatch;
+		if(this->storage() == Storage::linear) {
+			auto res = this->runLinear(batchMatcher());
+			auto matches = out.allocUndef<ResultMatch>(res.matches.size());
+			for(auto k = 0u; k < matches.size(); ++k) {
+				matches[k] = res.matches[k];
+			}
+
+			res.matches = matches;
+			return res;
+		}
+
+		while(step()) /*noop*/;
+
+		auto numMatches = 0u;
+		auto res = this->traceResult([&](const ResultMatch&) { ++numMatches; });
+		res.matches = out.allocUndef<ResultMatch>(numMatches);
+		this->traceResult([&, id = numMatches](const ResultMatch& match) mutable {
+			dlg_assert(id > 0u);
+			res.matches[--id] = match;
+		});
+
+		return res;
+	}
+
+	// Like run() but stops once the budget is exhausted, returning an
+	// approximate result, see Core::Budget. Completing the path then
+	// might still need up to 2 * (width + height) evaluations.
+	// The counters (numEvals, numSteps) include previous steps.
+	Result run(const typename Core::Budget& budget) {
+		ExtZoneScoped;
+
+		if(this->storage() == Storage::linear) {
+			return this->runLinear(batchMatcher());
+		}
+
+		auto checkDeadline = budget.deadline != std::chrono::steady_clock::time_point{};
+		for(auto k = 1u; !this->empty(); ++k) {
+			if((budget.maxEvals && this->numEvals_ >= budget.maxEvals) ||
+					(budget.maxSteps && this->numSteps_ >= budget.maxSteps)) {
+				return this->finishEarly(batchMatcher());
+			}
+
+			if(checkDeadline && k % Core::deadlineInterval == 0u &&
+					std::chrono::steady_clock::now() >= budget.deadline) {
+				return this->finishEarly(batchMatcher());
+			}
+
+			step();
+		}
+
+		return this->gatherResult();
+	}
+
+	// Returns false if there's nothing to do anymore.
+	bool step() {
+		ExtZoneScoped;
+
+		if constexpr(batched) {
+			return stepBatch();
+		} else {
+			return stepSingle();
+		}
+	}
+
+	// Uses the path of a previous result as starting point, e.g. from
+	// matching the previous versions of the sequences. The path is
+	// evaluated first and its score becomes the one to beat, so the
+	// search only explores where a better path might exist. If there
+	// is none, the result is the hint path.
+	// Matches outside of the sequences or not following their predecessor
+	// in both sequences are ignored.
+	// Must be called before step() or run().
+	void warmStart(span<const typename Core::ResultMatch> hint) {
+		this->seedHint(hint, batchMatcher());
+	}
+
+	// Starts over with a new problem, as if this object was newly
+	// constructed, but reuses the memory of the previous runs: the
+	// matrix (only grown when it is too small), the queue and the
+	// result buffers. Once large enough, a reset() and run() does not
+	// allocate anymore.
+	// The Params from construction are kept. Params::identical is
+	// called with the new sequences, so it must refer to them.
+	// Invalidates all results returned before.
+	void reset(u32 width, u32 height, MatcherT matcher) {
+		if constexpr(std::is_move_assignable_v<MatcherT>) {
+			matcher_ = std::move(matcher);
+		} else {
+			// e.g. lambdas with captures
+			std::destroy_at(&matcher_);
+			std::construct_at(&matcher_, std::move(matcher));
+		}
+
+		this->resetState(width, height);
+	}
+
+private:
+	auto batchMatcher() {
+		return [this](span<const LmmCell> cells, span<float> values) {
+			if constexpr(batched) {
+				matcher_(cells, values);
+			} else {
+				for(auto k = 0u; k < cells.size(); ++k) {
+					values[k] = matcher_(cells[k].i, cells[k].j);
+				}
+			}
+		};
+	}
+
+	bool stepSingle() requires (!batched) {
+		if(this->empty()) {
+			return false;
+		}
+
+		++this->numSteps_;
+		auto cand = this->popCandidate();
+
+		// should be true due to pruning
+		dlg_assert(this->maxPossibleScore(cand) >= this->bestMatch_);
+
+		auto& m = this->match(cand.i, cand.j);
+		m.setCandidate(0u);
+
+		// this invariant follows from the way we insert new candidates
+		// there is always at most one candidate per field
+		dlg_assert(m.best() == cand.score);
+
+		if(!m.evaluated() && !this->deferEval(cand, m)) {
+			m.setEval(matcher_(cand.i + this->prefix_, cand.j + this->prefix_));
+			++this->numEvals_;
+		}
+
+		this->expand(cand, m);
+		if(this->beamFull()) VIL_UNLIKELY {
+			this->trimBeam(batchMatcher());
+		}
+
+		return true;
+	}
+
+	bool stepBatch() requires batched {
+		if(this->empty()) {
+			return false;
+		}
+
+		// collect candidates and the fields that still need evaluation.
+		// Popping can't ever return a field twice since we don't insert
+		// new candidates here.
+		auto numCands = 0u;
+		auto numCells = 0u;
+		while(numCands < batchCands_.size() && !this->empty()) {
+			auto cand = this->popCandidate();
+			auto& m = this->match(cand.i, cand.j);
+			m.setCandidate(0u);
+			dlg_assert(m.best() == cand.score);
+
+			// Deferring stays valid while expanding the batch since
+			// bestMatch_ only increases
+			batchCands_[numCands++] = cand;
+			if(!m.evaluated() && !this->deferEval(cand, m)) {
+				batchCells_[numCells++] = {cand.i + this->prefix_, cand.j + this->prefix_};
+			}
+		}
+
+		if(numCells > 0u) {
+			matcher_(span<const LmmCell>(batchCells_.data(), numCells),
+				batchValues_.first(numCells));
+			this->numEvals_ += numCells;
+
+			for(auto k = 0u; k < numCells; ++k) {
+				auto& cell = batchCells_[k];
+				this->match(cell.i - this->prefix_, cell.j - this->prefix_).setEval(batchValues_[k]);
+			}
+		}
+
+		for(auto k = 0u; k < numCands; ++k) {
+			auto& cand = batchCands_[k];
+			auto& m = this->match(cand.i, cand.j);
+
+			// Expanding an earlier candidate of this batch might have
+			// found a better path to this field (it was then re-inserted
+			// as candidate) or made it irrelevant.
+			if(m.best() != cand.score) {
+				continue;
+			}
+
+			if(auto bound = this->maxPossibleScore(cand); bound < this->pruneLimit()) {
+				this->discard(bound);
+				continue;
+			}
+
+			++this->numSteps_;
+			this->expand(cand, m);
+		}
+
+		if(this->beamFull()) VIL_UNLIKELY {
+			this->trimBeam(batchMatcher());
+		}
+
+		return true;
+	}
+
+	MatcherT matcher_;
+
+	// only used for batched matchers
+	span<HeapCand> batchCands_;
+	span<LmmCell> batchCells_;
+	span<float> batchValues_;
+};
+
+extern template struct LazyMatrixMarchCore<u16>;
+extern template struct LazyMatrixMarchCore<u32>;
+extern template struct LazyMatrixMarchCore<u16, LazyMatrixMarchBase::CompactMatch>;
+
+// Type-erased versions, see LazyMatrixMarchBase::Matcher.
+using LazyMatrixMarch = LazyMatrixMarchT<LazyMatrixMarchBase::Matcher>;
+using LazyMatrixMarch32 = LazyMatrixMarchT<LazyMatrixMarchBase::Matcher, u32>;
+using LazyMatrixMarchCompact = LazyMatrixMarchT<LazyMatrixMarchBase::Matcher,
+	u16, LazyMatrixMarchBase::CompactMatch>;
+extern template struct LazyMatrixMarchT<LazyMatrixMarchBase::Matcher>;
+extern template struct LazyMatrixMarchT<LazyMatrixMarchBase::Matcher, u32>;
+extern template struct LazyMatrixMarchT<LazyMatrixMarchBase::Matcher,
+	u16, LazyMatrixMarchBase::CompactMatch>;
+
 float maxPossibleScore(float score, u32 width, u32 height, u32 i, u32 j);
 
 } // namespace vil
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <lmm.hpp>
+#include <lmmexec.hpp>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+namespace vil {
+
+struct LmmAnchorStats {
+	// Number of anchors the problem was split at
+	u32 numAnchors {};
+	// Number of gaps between the anchors that needed a LazyMatrixMarch
+	u32 numGaps {};
+	// Number of cells of the largest gap matrix
+	u64 maxGapCells {};
+	// Summed up LazyMatrixMarch::numEvals over all gaps, plus the
+	// evaluations of the anchors.
+	u64 numEvals {};
+};
+
+// Finds anchors for lmmAnchored: pairs (i, j) where hashesA[i] == hashesB[j]
+// and that hash occurs exactly once in both sequences. From those, the
+// largest set that is ordered in both sequences is chosen, like in
+// patience diff. Returns the anchors ordered by i, j.
+inline std::vector<LmmCell> lmmFindAnchors(span<const u64> hashesA,
+		span<const u64> hashesB) {
+	ExtZoneScoped;
+
+	struct Occurrence {
+		u32 countA;
+		u32 countB;
+		u32 i;
+		u32 j;
+	};
+
+	std::unordered_map<u64, Occurrence> occurrences;
+	occurrences.reserve(hashesA.size());
+	for(auto i = 0u; i < hashesA.size(); ++i) {
+		auto& occ = occurrences[hashesA[i]];
+		++occ.countA;
+		occ.i = i;
+	}
+
+	for(auto j = 0u; j < hashesB.size(); ++j) {
+		auto it = occurrences.find(hashesB[j]);
+		if(it != occurrences.end()) {
+			++it->second.countB;
+			it->second.j = j;
+		}
+	}
+
+	// unique pairs, ordered by i
+	std::vector<LmmCell> unique;
+	for(auto i = 0u; i < hashesA.size(); ++i) {
+		auto& occ = occurrences.find(hashesA[i])->second;
+		if(occ.countA == 1u && occ.countB == 1u) {
+			unique.push_back({i, occ.j});
+		}
+	}
+
+	// Longest increasing subsequence in j via patience sorting.
+	// tails[l] is the index (into unique) of the smallest j ending
+	// an increasing subsequence of length l + 1.
+	std::vector<u32> tails;
+	std::vector<u32> prev(unique.size());
+	for(auto k = 0u; k < unique.size(); ++k) {
+		auto it = std::lower_bound(tails.begin(), tails.end(), unique[k].j,
+			[&](u32 id, u32 j) { return unique[id].j < j; });
+		prev[k] = (it == tails.begin()) ? u32(-1) : *(it - 1);
+		if(it == tails.end()) {
+			tails.push_back(k);
+		} else {
+			*it = k;
+		}
+	}
+
+	std::vector<LmmCell> anchors(tails.size());
+	auto id = tails.empty() ? u32(-1) : tails.back();
+	for(auto k = anchors.size(); k-- > 0u;) {
+		anchors[k] = unique[id];
+		id = prev[id];
+	}
+
+	return anchors;
+}
+
+// Solves large, mostly similar problems by splitting them at unique
+// anchors (see lmmFindAnchors) and running a separate LazyMatrixMarch
+// for each gap between them. Instead of one huge matrix, only the small
+// gap matrices are needed, one at a time.
+// Assumes that elements with equal hashes match, the anchors are always
+// part of the result. So the result is not necessarily optimal: an
+// anchor might be a worse choice than the elements it excludes.
+// Anchors the matcher evaluates to 0.f are dropped. Result::gap only
+// covers the gaps, relative to the chosen anchors.
+// params are used for all gaps. Params::identical, maxMatchI, maxMatchJ
+// and matchBound, if given, still receive sequence coordinates.
+// The result is allocated from 'alloc'.
+// When an executor is given, the gaps are run on its threads, the
+// matcher must then be safe to call from multiple threads at once.
+// The result does not depend on whether or which executor is used.
+template<LmmMatcher MatcherT>
+LazyMatrixMarchBase::Result lmmAnchored(span<const u64> hashesA,
+		span<const u64> hashesB, LinAllocator& alloc, MatcherT matcher,
+		const LazyMatrixMarchBase::Params& params = {},
+		LmmAnchorStats* stats = nullptr, LmmExecutor* executor = nullptr) {
+	ExtZoneScoped;
+
+	using Result = LazyMatrixMarchBase::Result;
+	using ResultMatch = LazyMatrixMarchBase::ResultMatch;
+
+	// Evaluates the cells shifted by (i0, j0). Every gap gets its own
+	// evaluator, so they can run in parallel.
+	auto evaluator = [&](u32 i0, u32 j0) {
+		if constexpr(LmmBatchMatcher<MatcherT>) {
+			return [&, i0, j0, shifted = std::vector<LmmCell>{}](
+					span<const LmmCell> cells, span<float> values) mutable {
+				shifted.resize(cells.size());
+				for(auto k = 0u; k < cells.size(); ++k) {
+					shifted[k] = {i0 + cells[k].i, j0 + cells[k].j};
+				}
+
+				matcher(span<const LmmCell>(shifted), values);
+			};
+		} else {
+			return [&, i0, j0](u32 i, u32 j) {
+				return matcher(i0 + i, j0 + j);
+			};
+		}
+	};
+
+	LmmAnchorStats localStats;
+	auto& st = stats ? *stats : localStats;
+	st = {};
+
+	auto w = u32(hashesA.size());
+	auto h = u32(hashesB.size());
+	auto anchors = lmmFindAnchors(hashesA, hashesB);
+
+	// evaluate anchors
+	std::vector<float> anchorVals(anchors.size());
+	if constexpr(LmmBatchMatcher<MatcherT>) {
+		matcher(span<const LmmCell>(anchors), span<float>(anchorVals));
+	} else {
+		for(auto k = 0u; k < anchors.size(); ++k) {
+			anchorVals[k] = matcher(anchors[k].i, anchors[k].j);
+		}
+	}
+
+	st.numEvals += anchors.size();
+
+	auto numAnchors = 0u;
+	for(auto k = 0u; k < anchors.size(); ++k) {
+		if(anchorVals[k] > 0.f) {
+			anchorVals[numAnchors] = anchorVals[k];
+			anchors[numAnchors] = anchors[k];
+			++numAnchors;
+		}
+	}
+
+	st.numAnchors = numAnchors;
+
+	// The gap k lies in front of anchor k, the last one behind all anchors.
+	// Each gap gets a slot in the result that is large enough for its
+	// maximum number of matches, followed by the slot of its anchor.
+	struct Gap {
+		LmmCell begin;
+		LmmCell end;
+		std::size_t slot;
+		u32 numMatches;
+		float totalMatch;
+		// Result::gap of the gap
+		float maxLoss;
+		u64 numEvals;
+	};
+
+	std::vector<Gap> gaps(numAnchors + 1);
+	auto maxMatches = std::size_t(0u);
+	for(auto k = 0u; k <= numAnchors; ++k) {
+		auto& gap = gaps[k];
+		gap.begin = k == 0u ? LmmCell{0u, 0u} :
+			LmmCell{anchors[k - 1].i + 1, anchors[k - 1].j + 1};
+		gap.end = k == numAnchors ? LmmCell{w, h} : anchors[k];
+		gap.slot = maxMatches;
+
+		auto gw = gap.end.i - gap.begin.i;
+		auto gh = gap.end.j - gap.begin.j;
+		maxMatches += std::min(gw, gh) + (k < numAnchors ? 1u : 0u);
+		if(gw > 0u && gh > 0u) {
+			++st.numGaps;
+			st.maxGapCells = std::max(st.maxGapCells, u64(gw) * gh);
+		}
+	}
+
+	Result res {};
+	res.matches = alloc.alloc<ResultMatch>(maxMatches);
+
+	auto runGap = [&](u32 k, LinAllocator& gapAlloc) {
+		auto& gap = gaps[k];
+		auto begin = gap.begin;
+		auto gw = gap.end.i - begin.i;
+		auto gh = gap.end.j - begin.j;
+
+		auto gapParams = params;
+		if(params.identical) {
+			gapParams.identical = [&, begin](u32 i, u32 j) {
+				return params.identical(begin.i + i, begin.j + j);
+			};
+		}
+
+		if(params.maxMatchI) {
+			gapParams.maxMatchI = [&, begin](u32 i) {
+				return params.maxMatchI(begin.i + i);
+			};
+		}
+
+		if(params.maxMatchJ) {
+			gapParams.maxMatchJ = [&, begin](u32 j) {
+				return params.maxMatchJ(begin.j + j);
+			};
+		}
+
+		if(params.matchBound) {
+			gapParams.matchBound = [&, begin](u32 i, u32 j) {
+				return params.matchBound(begin.i + i, begin.j + j);
+			};
+		}
+
+		auto finish = [&](auto& lmm) {
+			auto gapRes = lmm.run();
+			gap.numEvals = lmm.numEvals();
+			gap.totalMatch = gapRes.totalMatch;
+			gap.maxLoss = gapRes.gap;
+			gap.numMatches = u32(gapRes.matches.size());
+			for(auto m = 0u; m < gapRes.matches.size(); ++m) {
+				auto& match = gapRes.matches[m];
+				res.matches[gap.slot + m] = {begin.i + match.i,
+					begin.j + match.j, match.matchVal};
+			}
+		};
+
+		if(std::max(gw, gh) <= (1u << 16)) {
+			LazyMatrixMarchT<decltype(evaluator(0u, 0u)), u16> lmm(gw, gh,
+				gapAlloc, evaluator(begin.i, begin.j), gapParams);
+			finish(lmm);
+		} else {
+			LazyMatrixMarchT<decltype(evaluator(0u, 0u)), u32> lmm(gw, gh,
+				gapAlloc, evaluator(begin.i, begin.j), gapParams);
+			finish(lmm);
+		}
+	};
+
+	std::vector<u32> nonEmpty;
+	for(auto k = 0u; k <= numAnchors; ++k) {
+		if(gaps[k].end.i > gaps[k].begin.i && gaps[k].end.j > gaps[k].begin.j) {
+			nonEmpty.push_back(k);
+		}
+	}
+
+	if(executor) {
+		executor->run(u32(nonEmpty.size()), [&](u32 id, LinAllocator& gapAlloc) {
+			runGap(nonEmpty[id], gapAlloc);
+		});
+	} else {
+		for(auto k : nonEmpty) {
+			// The gap matrix is only needed until we copied its result
+			LinAllocScope scope(alloc);
+			runGap(k, alloc);
+		}
+	}
+
+	// Merge in order, independent of how the gaps were run
+	auto numMatches = 0u;
+	for(auto k = 0u; k <= numAnchors; ++k) {
+		auto& gap = gaps[k];
+		st.numEvals += gap.numEvals;
+		res.totalMatch += gap.totalMatch;
+		res.gap += gap.maxLoss;
+		std::copy_n(res.matches.begin() + gap.slot, gap.numMatches,
+			res.matches.begin() + numMatches);
+		numMatches += gap.numMatches;
+
+		if(k < numAnchors) {
+			res.totalMatch += anchorVals[k];
+			res.matches[numMatches++] = {anchors[k].i, anchors[k].j, anchorVals[k]};
+		}
+	}
+
+	res.matches = res.matches.first(numMatches);
+	return res;
+}
+
+} // namespace vil
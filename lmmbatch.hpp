@@ -0,0 +1,135 @@
+#pragma once
+
+#include <lmm.hpp>
+#include <lmmexec.hpp>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+namespace vil {
+
+// Dimensions of one matching problem in a batch, see LmmBatchRunner.
+struct LmmJob {
+	u32 width;
+	u32 height;
+};
+
+// Matcher for a whole batch, like LmmCellMatcher but additionally
+// getting the index of the job the cell belongs to.
+template<typename F>
+concept LmmJobMatcher = std::is_invocable_r_v<float, F&, u32, u32, u32>;
+
+struct LmmBatchResult {
+	// One result per job, in the same order as the jobs.
+	// Their matches are all stored in 'matches', in job order.
+	span<LazyMatrixMarchBase::Result> results;
+	span<LazyMatrixMarchBase::ResultMatch> matches;
+};
+
+// Runs many small, independent matching problems, e.g. all the command
+// hierarchies of one frame. For problems with just a few elements,
+// setting up a LazyMatrixMarch costs about as much as the search itself,
+// so the runner avoids everything that can be avoided:
+// - the matcher is a template parameter shared by all jobs, there
+//   is no std::function per job
+// - all scratch memory (matrix, queue) comes from a LinAllocator owned by
+//   the runner that is rewound after each job, so after the first
+//   batch, no job allocates anymore
+// - the results are packed into two allocations from the output allocator
+// With an executor, the jobs are spread over its threads, using their
+// allocators as scratch memory. The output is the same either way.
+class LmmBatchRunner {
+public:
+	using Params = LazyMatrixMarchBase::Params;
+	using Result = LazyMatrixMarchBase::Result;
+	using ResultMatch = LazyMatrixMarchBase::ResultMatch;
+
+	// Queue::heap is the cheapest to set up, the queues of tiny
+	// problems never get large anyways.
+	static Params defaultParams() {
+		Params params;
+		params.queue = LazyMatrixMarchBase::Queue::heap;
+		return params;
+	}
+
+	explicit LmmBatchRunner(const Params& params = defaultParams()) :
+		params_(params) {
+	}
+
+	// Runs matcher(job, i, j) based matching for all jobs. Jobs with
+	// an empty sequence get an empty result.
+	// The result is allocated from 'out'.
+	// With an executor, the matcher must be safe to call from multiple
+	// threads at once.
+	template<LmmJobMatcher MatcherT>
+	LmmBatchResult run(span<const LmmJob> jobs, LinAllocator& out,
+			MatcherT&& matcher, LmmExecutor* executor = nullptr) {
+		ExtZoneScoped;
+
+		LmmBatchResult ret;
+		ret.results = out.alloc<Result>(jobs.size());
+
+		// Every job gets a slot large enough for its maximum number
+		// of matches, compacted at the end.
+		slots_.resize(jobs.size());
+		auto maxMatches = std::size_t(0u);
+		for(auto k = 0u; k < jobs.size(); ++k) {
+			// only u16 indices are used, jobs are expected to be small
+			dlg_assert(jobs[k].width <= (1u << 16) && jobs[k].height <= (1u << 16));
+			slots_[k] = maxMatches;
+			maxMatches += std::min(jobs[k].width, jobs[k].height);
+		}
+
+		ret.matches = out.alloc<ResultMatch>(maxMatches);
+
+		auto runJob = [&](u32 k, LinAllocator& scratch) {
+			auto& job = jobs[k];
+			auto& res = ret.results[k];
+			if(job.width == 0u || job.height == 0u) {
+				res = {0.f, {}};
+				return;
+			}
+
+			auto jobMatcher = [&matcher, k](u32 i, u32 j) -> float {
+				return matcher(k, i, j);
+			};
+
+			LazyMatrixMarchT<decltype(jobMatcher)> lmm(job.width, job.height,
+				scratch, jobMatcher, params_);
+			auto jobRes = lmm.run();
+
+			res.totalMatch = jobRes.totalMatch;
+			res.gap = jobRes.gap;
+			res.matches = ret.matches.subspan(slots_[k], jobRes.matches.size());
+			std::copy(jobRes.matches.begin(), jobRes.matches.end(), res.matches.begin());
+		};
+
+		if(executor) {
+			executor->run(u32(jobs.size()), runJob);
+		} else {
+			for(auto k = 0u; k < jobs.size(); ++k) {
+				LinAllocScope scope(scratch_);
+				runJob(k, scratch_);
+			}
+		}
+
+		// Compact, in job order
+		auto numMatches = std::size_t(0u);
+		for(auto& res : ret.results) {
+			auto dst = ret.matches.subspan(numMatches, res.matches.size());
+			std::copy(res.matches.begin(), res.matches.end(), dst.begin());
+			res.matches = dst;
+			numMatches += dst.size();
+		}
+
+		ret.matches = ret.matches.first(numMatches);
+		return ret;
+	}
+
+private:
+	Params params_;
+	LinAllocator scratch_;
+	std::vector<std::size_t> slots_;
+};
+
+} // namespace vil
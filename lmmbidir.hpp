@@ -0,0 +1,263 @@
+#pragma once
+
+#include <lmm.hpp>
+#include <algorithm>
+#include <vector>
+
+namespace vil {
+
+struct LmmBidirStats {
+	u64 numStepsForward {};
+	u64 numStepsReverse {};
+	// Matcher calls. Cells that both directions needed count once.
+	u64 numEvals {};
+	// Whether the result was joined from a forward and a reverse path.
+	// Otherwise one direction completed on its own.
+	bool joined {};
+	// The matches of the forward path are all in front of (splitI,
+	// splitJ), the ones of the reverse path at or behind it. Splitting
+	// the problem there gives two independent subproblems.
+	u32 splitI {};
+	u32 splitJ {};
+};
+
+// Runs a LazyMatrixMarch forward from (0, 0) and one on the reversed
+// sequences, i.e. backwards from (width - 1, height - 1), at the same
+// time. Whenever a direction pops a candidate the other one has already
+// reached, the two paths are joined. Once the best joined path is at
+// least the maxPossibleScore of one direction, it can't be beaten
+// anymore and the search stops. The direction with the lower
+// maxPossibleScore is stepped, since it is closer to that. Ties alternate.
+// NOTE: with the bound of maxPossibleScore, both directions have to
+// explore a region where the sequences differ, no matter on which end
+// it is. So this rarely needs much fewer evaluations than run(), but
+// its split point allows solving the two halves independently.
+// The result is optimal under the same conditions as the one of run().
+// Cells evaluated by one direction are reused by the other.
+// Params::identical, warmStart() and Storage::linear are not supported,
+// maxMatchI, maxMatchJ and matchBound still receive sequence coordinates.
+// The result is allocated from 'alloc'.
+template<typename IndexT = u16, typename CellT = LazyMatrixMarchBase::EvalMatch,
+	LmmMatcher MatcherT>
+LazyMatrixMarchBase::Result lmmBidirectional(u32 width, u32 height,
+		LinAllocator& alloc, MatcherT matcher,
+		const LazyMatrixMarchBase::Params& params = {},
+		LmmBidirStats* stats = nullptr) {
+	ExtZoneScoped;
+
+	using Core = LazyMatrixMarchCore<IndexT, CellT>;
+	using Result = LazyMatrixMarchBase::Result;
+	using ResultMatch = LazyMatrixMarchBase::ResultMatch;
+
+	dlg_assert(!params.identical);
+	dlg_assert(params.storage != LazyMatrixMarchBase::Storage::linear);
+
+	LmmBidirStats localStats;
+	auto& st = stats ? *stats : localStats;
+	st = {};
+
+	auto w = width;
+	auto h = height;
+	auto maxMatches = std::min(w, h);
+
+	Result res {};
+	res.matches = alloc.alloc<ResultMatch>(maxMatches);
+
+	// The marches are only needed until we copied the result
+	LinAllocScope scope(alloc);
+	auto path = scope.alloc<ResultMatch>(maxMatches);
+	auto prefix = scope.alloc<ResultMatch>(maxMatches);
+	auto suffix = scope.alloc<ResultMatch>(maxMatches);
+	auto numPath = 0u;
+	auto joinedScore = -1.f;
+
+	// Evaluates cells of one direction. 'other' is the other direction,
+	// cell (i, j) is cell (w - 1 - i, h - 1 - j) there.
+	const Core* fwd {};
+	const Core* rev {};
+	auto evaluator = [&](const Core*& other, bool reverse) {
+		auto mirror = [&, reverse](u32 i, u32 j) {
+			return reverse ? LmmCell{w - 1 - i, h - 1 - j} : LmmCell{i, j};
+		};
+
+		if constexpr(LmmBatchMatcher<MatcherT>) {
+			return [&, mirror, cells = std::vector<LmmCell>{},
+					values = std::vector<float>{}](
+					span<const LmmCell> in, span<float> out) mutable {
+				cells.clear();
+				for(auto k = 0u; k < in.size(); ++k) {
+					auto& m = other->matchData(w - 1 - in[k].i, h - 1 - in[k].j);
+					out[k] = m.eval();
+					if(!m.evaluated()) {
+						cells.push_back(mirror(in[k].i, in[k].j));
+					}
+				}
+
+				values.resize(cells.size());
+				matcher(span<const LmmCell>(cells), span<float>(values));
+				st.numEvals += cells.size();
+
+				auto id = 0u;
+				for(auto& val : out) {
+					if(val < 0.f) {
+						val = values[id++];
+					}
+				}
+			};
+		} else {
+			return [&, mirror](u32 i, u32 j) {
+				auto& m = other->matchData(w - 1 - i, h - 1 - j);
+				if(m.evaluated()) {
+					return m.eval();
+				}
+
+				++st.numEvals;
+				auto cell = mirror(i, j);
+				return float(matcher(cell.i, cell.j));
+			};
+		}
+	};
+
+	auto revParams = params;
+	if(params.maxMatchI) {
+		revParams.maxMatchI = [&](u32 i) { return params.maxMatchI(w - 1 - i); };
+	}
+
+	if(params.maxMatchJ) {
+		revParams.maxMatchJ = [&](u32 j) { return params.maxMatchJ(h - 1 - j); };
+	}
+
+	if(params.matchBound) {
+		revParams.matchBound = [&](u32 i, u32 j) {
+			return params.matchBound(w - 1 - i, h - 1 - j);
+		};
+	}
+
+	LazyMatrixMarchT<decltype(evaluator(rev, false)), IndexT, CellT> fwdLmm(
+		w, h, alloc, evaluator(rev, false), params);
+	LazyMatrixMarchT<decltype(evaluator(fwd, true)), IndexT, CellT> revLmm(
+		w, h, alloc, evaluator(fwd, true), revParams);
+	fwd = &fwdLmm;
+	rev = &revLmm;
+
+	// Joins the path to the top candidate of 'lmm' with the path of the
+	// other direction to the same lattice point, if there is one.
+	auto join = [&](Core& lmm, Core& other, bool reverse) {
+		auto cand = lmm.peekCandidate();
+		if(cand.i == 0u || cand.j == 0u) {
+			// the other direction must complete the path on its own
+			return;
+		}
+
+		// cell (i, j) is the lattice point (w - i, h - j) of the other one
+		auto oi = w - cand.i;
+		auto oj = h - cand.j;
+		auto otherScore = other.matchData(oi, oj).best();
+		if(otherScore < 0.f || cand.score + otherScore <= joinedScore) {
+			return;
+		}
+
+		auto prefixID = maxMatches;
+		auto suffixID = maxMatches;
+		[[maybe_unused]] auto traced = lmm.traceBack(cand.i, cand.j, prefix, prefixID);
+		dlg_assert(traced);
+
+		// Might still have improvements that weren't propagated
+		if(!other.traceBack(oi, oj, suffix, suffixID)) {
+			return;
+		}
+
+		auto& fwdPart = reverse ? suffix : prefix;
+		auto& revPart = reverse ? prefix : suffix;
+		auto fwdID = reverse ? suffixID : prefixID;
+		auto revID = reverse ? prefixID : suffixID;
+
+		numPath = 0u;
+		for(auto k = fwdID; k < maxMatches; ++k) {
+			path[numPath++] = fwdPart[k];
+		}
+
+		for(auto k = maxMatches; k-- > revID;) {
+			auto& match = revPart[k];
+			path[numPath++] = {w - 1 - match.i, h - 1 - match.j, match.matchVal};
+		}
+
+		joinedScore = cand.score + otherScore;
+		st.splitI = reverse ? oi : cand.i;
+		st.splitJ = reverse ? oj : cand.j;
+	};
+
+	auto output = [&](const Result& dirRes, bool reverse) {
+		res.totalMatch = dirRes.totalMatch;
+		res.gap = dirRes.gap;
+		res.matches = res.matches.first(dirRes.matches.size());
+		if(reverse) {
+			auto n = dirRes.matches.size();
+			for(auto k = 0u; k < n; ++k) {
+				auto& match = dirRes.matches[n - 1 - k];
+				res.matches[k] = {w - 1 - match.i, h - 1 - match.j, match.matchVal};
+			}
+		} else {
+			std::copy(dirRes.matches.begin(), dirRes.matches.end(), res.matches.begin());
+		}
+	};
+
+	auto finish = [&](auto& lmm, bool reverse) {
+		// A path found by a single direction might only be as good as
+		// the joined one
+		if(lmm.bestMatch() <= joinedScore) {
+			st.joined = true;
+			res.totalMatch = joinedScore;
+			res.gap = std::max(std::max(fwdLmm.discardBound(),
+				revLmm.discardBound()) - joinedScore, 0.f);
+			res.matches = res.matches.first(numPath);
+			std::copy_n(path.begin(), numPath, res.matches.begin());
+		} else {
+			output(lmm.run(), reverse);
+		}
+
+		st.numStepsForward = fwdLmm.numSteps();
+		st.numStepsReverse = revLmm.numSteps();
+		return res;
+	};
+
+	auto lastForward = false;
+	while(true) {
+		// When no candidate of a direction can beat its best complete
+		// path anymore, completing it is cheap.
+		if(fwdLmm.empty() || fwdLmm.peekBound() <= fwdLmm.bestMatch()) {
+			return finish(fwdLmm, false);
+		} else if(revLmm.empty() || revLmm.peekBound() <= revLmm.bestMatch()) {
+			return finish(revLmm, true);
+		}
+
+		// The search ends once the bound of one direction drops to the
+		// joined score, so we push the one that is closer to that.
+		auto boundFwd = fwdLmm.peekBound();
+		auto boundRev = revLmm.peekBound();
+		auto forward = boundFwd < boundRev || (boundFwd == boundRev && !lastForward);
+		lastForward = forward;
+
+		if(forward) {
+			join(fwdLmm, revLmm, false);
+		} else {
+			join(revLmm, fwdLmm, true);
+		}
+
+		// Nothing in this direction can beat the joined path anymore.
+		// Since it's the best path through any of the remaining
+		// candidates, there is no better one.
+		auto& lmm = forward ? static_cast<Core&>(fwdLmm) : static_cast<Core&>(revLmm);
+		if(lmm.peekBound() <= joinedScore) {
+			return forward ? finish(fwdLmm, false) : finish(revLmm, true);
+		}
+
+		if(forward) {
+			fwdLmm.step();
+		} else {
+			revLmm.step();
+		}
+	}
+}
+
+} // namespace vil
@@ -0,0 +1,80 @@
+#include <lmmcache.hpp>
+#include <algorithm>
+#include <bit>
+
+namespace vil {
+
+LmmMatchCache::LmmMatchCache(u32 numSlots) {
+	numSlots = std::bit_ceil(std::max(numSlots, probeWindow));
+	slots_.resize(numSlots);
+	mask_ = numSlots - 1u;
+}
+
+u32 LmmMatchCache::home(u64 idA, u64 idB) const {
+	// Identities might be pointers or counters, mix them well
+	auto h = idA * 0x9e3779b97f4a7c15ull;
+	h ^= idB + 0x632be59bd9b4e019ull + (h << 6) + (h >> 2);
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 32;
+	return u32(h) & mask_;
+}
+
+float LmmMatchCache::find(u64 idA, u64 idB) {
+	auto pos = home(idA, idB);
+	for(auto k = 0u; k < probeWindow; ++k) {
+		auto& slot = slots_[(pos + k) & mask_];
+		if(!slot.used) {
+			break;
+		}
+
+		if(slot.idA == idA && slot.idB == idB) {
+			slot.referenced = true;
+			++stats_.numHits;
+			return slot.value;
+		}
+	}
+
+	++stats_.numMisses;
+	return -1.f;
+}
+
+void LmmMatchCache::insert(u64 idA, u64 idB, float value) {
+	dlg_assert(value >= 0.f);
+
+	auto pos = home(idA, idB);
+	for(auto k = 0u; k < probeWindow; ++k) {
+		auto& slot = slots_[(pos + k) & mask_];
+		if(!slot.used) {
+			slot = {idA, idB, value, true, false};
+			++size_;
+			return;
+		}
+
+		if(slot.idA == idA && slot.idB == idB) {
+			slot.value = value;
+			return;
+		}
+	}
+
+	// Window is full. Terminates after at most two rounds since
+	// the first one clears all marks.
+	while(true) {
+		auto& slot = slots_[(pos + hand_) & mask_];
+		hand_ = (hand_ + 1u) % probeWindow;
+		if(!slot.referenced) {
+			slot = {idA, idB, value, true, false};
+			++stats_.numEvictions;
+			return;
+		}
+
+		slot.referenced = false;
+	}
+}
+
+void LmmMatchCache::clear() {
+	std::fill(slots_.begin(), slots_.end(), Slot{});
+	size_ = 0u;
+	hand_ = 0u;
+}
+
+} // namespace vil
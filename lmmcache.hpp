@@ -0,0 +1,124 @@
+#pragma once
+
+#include <lmm.hpp>
+#include <vector>
+
+namespace vil {
+
+struct LmmCacheStats {
+	// Lookups that found their pair
+	u64 numHits {};
+	// Lookups that didn't, i.e. matcher calls through wrap()
+	u64 numMisses {};
+	// Entries that were replaced to make room for a new one
+	u64 numEvictions {};
+};
+
+// Cache for matcher results that persists across LazyMatrixMarch runs.
+// Between consecutive frames, most of the compared element pairs are the
+// same objects again, so their match values don't have to be computed
+// again. Callers provide a stable 64-bit identity per element, values
+// are stored per pair of identities.
+// The table has a fixed number of slots and uses open addressing: a pair
+// is stored in one of the probeWindow slots following its hash. When
+// all of them are used, one is evicted via the clock (second chance)
+// algorithm: hits mark the slot as referenced and the eviction clears
+// these marks, starting at a rotating position, until it finds an
+// unmarked slot. New entries are unmarked, so pairs that are only
+// needed once are evicted first. Entries are never removed otherwise,
+// which allows lookups to stop at the first unused slot.
+// Not thread-safe. When running with an LmmExecutor, use one cache per
+// thread or none at all.
+class LmmMatchCache {
+public:
+	static constexpr u32 probeWindow = 8u;
+
+	// The number of slots is rounded up to a power of two,
+	// at least probeWindow.
+	explicit LmmMatchCache(u32 numSlots = 1u << 16);
+
+	// Returns the cached match value of the pair, -1.f if there is none.
+	float find(u64 idA, u64 idB);
+	// Stores the match value of the pair, evicting another one if needed.
+	void insert(u64 idA, u64 idB, float value);
+	// Removes all entries. Does not reset the stats.
+	void clear();
+
+	const LmmCacheStats& stats() const { return stats_; }
+	void resetStats() { stats_ = {}; }
+	u32 numSlots() const { return u32(slots_.size()); }
+	u32 size() const { return size_; }
+
+	// Wraps a matcher for the sequences with the given element identities,
+	// so that it's only called for pairs not in the cache. The result is
+	// a matcher of the same kind, see LmmMatcher. It references this
+	// cache, the identities and 'matcher', they must outlive it.
+	template<LmmMatcher MatcherT>
+	auto wrap(span<const u64> idsA, span<const u64> idsB, MatcherT& matcher);
+
+private:
+	struct Slot {
+		u64 idA;
+		u64 idB;
+		float value;
+		// Whether the slot holds an entry
+		bool used;
+		// Clock mark, set on every hit
+		bool referenced;
+	};
+
+	// First slot of the probe window of the pair
+	u32 home(u64 idA, u64 idB) const;
+
+	std::vector<Slot> slots_;
+	u32 mask_ {};
+	u32 size_ {};
+	// Position in the probe window where the next eviction starts
+	u32 hand_ {};
+	LmmCacheStats stats_;
+};
+
+template<LmmMatcher MatcherT>
+auto LmmMatchCache::wrap(span<const u64> idsA, span<const u64> idsB,
+		MatcherT& matcher) {
+	if constexpr(LmmBatchMatcher<MatcherT>) {
+		// Only the missing cells are passed on, in one call
+		return [this, idsA, idsB, &matcher, misses = std::vector<LmmCell>{},
+				missIDs = std::vector<u32>{}, values = std::vector<float>{}](
+				span<const LmmCell> cells, span<float> out) mutable {
+			misses.clear();
+			missIDs.clear();
+			for(auto k = 0u; k < cells.size(); ++k) {
+				out[k] = find(idsA[cells[k].i], idsB[cells[k].j]);
+				if(out[k] < 0.f) {
+					misses.push_back(cells[k]);
+					missIDs.push_back(k);
+				}
+			}
+
+			if(misses.empty()) {
+				return;
+			}
+
+			values.resize(misses.size());
+			matcher(span<const LmmCell>(misses), span<float>(values));
+
+			for(auto k = 0u; k < misses.size(); ++k) {
+				out[missIDs[k]] = values[k];
+				insert(idsA[misses[k].i], idsB[misses[k].j], values[k]);
+			}
+		};
+	} else {
+		return [this, idsA, idsB, &matcher](u32 i, u32 j) {
+			auto value = find(idsA[i], idsB[j]);
+			if(value < 0.f) {
+				value = float(matcher(i, j));
+				insert(idsA[i], idsB[j], value);
+			}
+
+			return value;
+		};
+	}
+}
+
+} // namespace vil
@@ -0,0 +1,149 @@
+#include <lmmexec.hpp>
+#include <algorithm>
+
+namespace vil {
+
+LmmExecutor::LmmExecutor(u32 numThreads) {
+	numThreads = std::max(numThreads, 1u);
+	for(auto i = 0u; i < numThreads; ++i) {
+		workers_.push_back(std::make_unique<Worker>());
+	}
+
+	// worker 0 is the thread calling run()
+	for(auto i = 1u; i < numThreads; ++i) {
+		threads_.emplace_back([this, i]{ threadMain(i); });
+	}
+}
+
+LmmExecutor::~LmmExecutor() {
+	{
+		std::lock_guard lock(mutex_);
+		exit_ = true;
+	}
+
+	cv_.notify_all();
+	for(auto& thread : threads_) {
+		thread.join();
+	}
+}
+
+void LmmExecutor::run(u32 count, const Task& task) {
+	ExtZoneScoped;
+
+	if(count == 0u) {
+		return;
+	}
+
+	numSteals_ = 0u;
+
+	// Contiguous ranges per worker, neighboring tasks are often
+	// similar in size.
+	auto numWorkers = u32(workers_.size());
+	for(auto w = 0u; w < numWorkers; ++w) {
+		auto begin = u32(u64(count) * w / numWorkers);
+		auto end = u32(u64(count) * (w + 1) / numWorkers);
+
+		std::lock_guard lock(workers_[w]->mutex);
+		dlg_assert(workers_[w]->queue.empty());
+		for(auto id = begin; id < end; ++id) {
+			workers_[w]->queue.push_back(id);
+		}
+	}
+
+	{
+		std::lock_guard lock(mutex_);
+		task_ = &task;
+		numRemaining_ = count;
+		numBusy_ = numWorkers;
+		++generation_;
+	}
+
+	cv_.notify_all();
+	work(0u);
+
+	// Wait for the other threads to finish their last tasks. They might
+	// still be inside work() when all tasks are done, so we also wait
+	// for them to leave it before task_ becomes invalid.
+	std::unique_lock lock(mutex_);
+	cv_.wait(lock, [&]{ return numBusy_ == 0u; });
+	dlg_assert(numRemaining_ == 0u);
+	task_ = nullptr;
+}
+
+void LmmExecutor::threadMain(u32 id) {
+	u64 seen = 0u;
+	while(true) {
+		{
+			std::unique_lock lock(mutex_);
+			cv_.wait(lock, [&]{ return exit_ || generation_ != seen; });
+			if(exit_) {
+				return;
+			}
+
+			seen = generation_;
+		}
+
+		work(id);
+	}
+}
+
+void LmmExecutor::work(u32 id) {
+	auto& worker = *workers_[id];
+	const Task* task;
+	{
+		std::lock_guard lock(mutex_);
+		task = task_;
+	}
+
+	u32 taskID;
+	auto numDone = 0u;
+	while(pop(id, taskID)) {
+		{
+			LinAllocScope scope(worker.alloc);
+			(*task)(taskID, worker.alloc);
+		}
+
+		++numDone;
+	}
+
+	{
+		std::lock_guard lock(mutex_);
+		numRemaining_ -= numDone;
+		--numBusy_;
+	}
+
+	cv_.notify_all();
+}
+
+bool LmmExecutor::pop(u32 id, u32& task) {
+	// Own queue from the back
+	{
+		auto& worker = *workers_[id];
+		std::lock_guard lock(worker.mutex);
+		if(!worker.queue.empty()) {
+			task = worker.queue.back();
+			worker.queue.pop_back();
+			return true;
+		}
+	}
+
+	// Steal from the front of the others. Tasks are never added
+	// during a run, so once all queues are empty, we are done.
+	auto numWorkers = u32(workers_.size());
+	for(auto off = 1u; off < numWorkers; ++off) {
+		auto& victim = *workers_[(id + off) % numWorkers];
+		std::lock_guard lock(victim.mutex);
+		if(!victim.queue.empty()) {
+			task = victim.queue.front();
+			victim.queue.pop_front();
+
+			std::lock_guard countLock(mutex_);
+			++numSteals_;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+} // namespace vil
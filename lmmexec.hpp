@@ -0,0 +1,73 @@
+#pragma once
+
+#include <linalloc.hpp>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vil {
+
+// Runs independent tasks, e.g. one LazyMatrixMarch per anchored gap, on a
+// fixed set of worker threads. Every thread owns a LinAllocator that
+// tasks can use for their scratch memory (like the LazyMatrixMarch
+// matrix), it's reset after each task.
+// Tasks are distributed over per-thread queues up front, idle threads
+// steal from the others so unevenly sized tasks still balance out.
+// Tasks must not depend on the order they are run in or on the thread
+// they run on, results should be written to a slot per task id and
+// merged by the caller. That way, the output never depends on the
+// number of threads.
+class LmmExecutor {
+public:
+	// The calling thread of run() always participates, so only
+	// numThreads - 1 threads are started. With numThreads <= 1,
+	// everything runs on the calling thread.
+	explicit LmmExecutor(u32 numThreads = std::thread::hardware_concurrency());
+	~LmmExecutor();
+
+	LmmExecutor(const LmmExecutor&) = delete;
+	LmmExecutor& operator=(const LmmExecutor&) = delete;
+
+	using Task = std::function<void(u32 id, LinAllocator& alloc)>;
+
+	// Runs task(id, alloc) for all ids in [0, count) and returns when
+	// all of them have finished. Must not be called from multiple threads
+	// (or from inside a task) at the same time.
+	void run(u32 count, const Task& task);
+
+	u32 numThreads() const { return u32(workers_.size()); }
+
+	// debug information, for the last run() call
+	u32 numSteals() const { return numSteals_; }
+
+private:
+	struct Worker {
+		std::mutex mutex;
+		std::deque<u32> queue;
+		LinAllocator alloc;
+	};
+
+	void threadMain(u32 id);
+	void work(u32 id);
+	bool pop(u32 id, u32& task);
+
+	std::vector<std::unique_ptr<Worker>> workers_;
+	std::vector<std::thread> threads_;
+
+	// Guards everything below
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	const Task* task_ {};
+	u64 generation_ {};
+	u32 numRemaining_ {};
+	u32 numBusy_ {};
+	bool exit_ {};
+
+	u32 numSteals_ {};
+};
+
+} // namespace vil
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <lmm.hpp>
+#include <algorithm>
+#include <concepts>
+#include <unordered_map>
+
+namespace vil {
+
+// Describes two trees (or forests) of nodes to be matched by LmmTreeMatcher.
+// Nodes are identified by ids, the ids of the first tree (A) and the
+// second tree (B) are independent of each other.
+// - childrenA(a)/childrenB(b) return the children of a node.
+// - compare(a, b) returns how well two nodes match on their own, without
+//   their children, in range [0, 1]. Nodes with a value of 0 never match
+//   and their children aren't compared.
+// Children may be shared between nodes but there must not be cycles.
+template<typename D>
+concept LmmTreeDesc = requires(const D& desc, u32 a, u32 b) {
+	{ desc.childrenA(a) } -> std::convertible_to<span<const u32>>;
+	{ desc.childrenB(b) } -> std::convertible_to<span<const u32>>;
+	{ desc.compare(a, b) } -> std::convertible_to<float>;
+};
+
+// A match between node 'a' of the first and node 'b' of the second tree.
+// The matches of their children are stored in the same flat array, at
+// [childrenBegin, childrenBegin + childrenCount).
+struct LmmTreeMatch {
+	u32 a;
+	u32 b;
+	float matchVal;
+	u32 childrenBegin;
+	u32 childrenCount;
+};
+
+struct LmmTreeResult {
+	// accumulated matching value of the best path between the roots
+	float totalMatch;
+	// The matches of the roots, the first entries of 'nodes'
+	span<LmmTreeMatch> roots;
+	// All matches, children always follow their parents.
+	span<LmmTreeMatch> nodes;
+};
+
+// Matches two trees by running LazyMatrixMarch on every level: the match
+// value of two nodes is their own match value combined with the best
+// alignment of their children,
+//   (compare(a, b) + childMatch) / (1 + max(numChildrenA, numChildrenB)),
+// so it stays in range [0, 1].
+// The value and children alignment of every compared pair of nodes is
+// memoized, so no pair is ever aligned twice in one match() call.
+template<LmmTreeDesc Desc>
+class LmmTreeMatcher {
+public:
+	using Params = LazyMatrixMarchBase::Params;
+	using ResultMatch = LazyMatrixMarchBase::ResultMatch;
+
+	// desc: must outlive this object
+	// params: the parameters used for the LazyMatrixMarch on all levels.
+	LmmTreeMatcher(const Desc& desc, const Params& params = {}) :
+		desc_(desc), params_(params) {
+	}
+
+	// Matches the given root nodes and their subtrees. The returned
+	// result is allocated from 'out'.
+	LmmTreeResult match(span<const u32> rootsA, span<const u32> rootsB,
+			LinAllocator& out) {
+		ExtZoneScoped;
+
+		memo_.clear();
+		scratch_.reset();
+		numAlignments_ = 0u;
+		numMemoHits_ = 0u;
+
+		auto roots = align(rootsA, rootsB);
+
+		// Allocate exactly what we need
+		auto count = u32(roots.matches.size());
+		for(auto& match : roots.matches) {
+			count += countDescendants(rootsA[match.i], rootsB[match.j]);
+		}
+
+		LmmTreeResult res;
+		res.totalMatch = roots.totalMatch;
+		res.nodes = out.alloc<LmmTreeMatch>(count);
+		res.roots = res.nodes.first(roots.matches.size());
+
+		// Breadth-first, so all children of a node are stored contiguously.
+		auto end = u32(roots.matches.size());
+		for(auto k = 0u; k < roots.matches.size(); ++k) {
+			auto& match = roots.matches[k];
+			res.nodes[k] = {rootsA[match.i], rootsB[match.j], match.matchVal, 0u, 0u};
+		}
+
+		for(auto k = 0u; k < end; ++k) {
+			auto& node = res.nodes[k];
+			auto& memo = memo_.find(key(node.a, node.b))->second;
+			auto childrenA = span<const u32>(desc_.childrenA(node.a));
+			auto childrenB = span<const u32>(desc_.childrenB(node.b));
+
+			node.childrenBegin = end;
+			node.childrenCount = u32(memo.children.size());
+			for(auto& child : memo.children) {
+				res.nodes[end++] = {childrenA[child.i], childrenB[child.j],
+					child.matchVal, 0u, 0u};
+			}
+		}
+
+		dlg_assert(end == count);
+		return res;
+	}
+
+	// debug information, for the last match() call
+	u64 numAlignments() const { return numAlignments_; }
+	u64 numMemoHits() const { return numMemoHits_; }
+
+private:
+	struct Memo {
+		float value;
+		// alignment of the children, allocated from scratch_
+		span<ResultMatch> children;
+	};
+
+	static u64 key(u32 a, u32 b) {
+		return (u64(a) << 32u) | b;
+	}
+
+	LazyMatrixMarchBase::Result align(span<const u32> nodesA, span<const u32> nodesB) {
+		if(nodesA.empty() || nodesB.empty()) {
+			return {0.f, {}};
+		}
+
+		++numAlignments_;
+		auto matcher = [&](u32 i, u32 j) {
+			return matchNodes(nodesA[i], nodesB[j]);
+		};
+
+		LazyMatrixMarchT lmm(u32(nodesA.size()), u32(nodesB.size()),
+			scratch_, matcher, params_);
+		return lmm.run();
+	}
+
+	float matchNodes(u32 a, u32 b) {
+		if(auto it = memo_.find(key(a, b)); it != memo_.end()) {
+			++numMemoHits_;
+			return it->second.value;
+		}
+
+		Memo memo {};
+		auto own = desc_.compare(a, b);
+		dlg_assert(own >= 0.f && own <= 1.f);
+		if(own > 0.f) {
+			auto childrenA = span<const u32>(desc_.childrenA(a));
+			auto childrenB = span<const u32>(desc_.childrenB(b));
+			auto children = align(childrenA, childrenB);
+			auto total = 1.f + std::max(childrenA.size(), childrenB.size());
+
+			memo.value = (own + children.totalMatch) / total;
+			memo.children = children.matches;
+		}
+
+		memo_.emplace(key(a, b), memo);
+		return memo.value;
+	}
+
+	u32 countDescendants(u32 a, u32 b) const {
+		auto& memo = memo_.find(key(a, b))->second;
+		auto childrenA = span<const u32>(desc_.childrenA(a));
+		auto childrenB = span<const u32>(desc_.childrenB(b));
+
+		auto count = u32(memo.children.size());
+		for(auto& child : memo.children) {
+			count += countDescendants(childrenA[child.i], childrenB[child.j]);
+		}
+
+		return count;
+	}
+
+	const Desc& desc_;
+	Params params_;
+	LinAllocator scratch_;
+	std::unordered_map<u64, Memo> memo_;
+
+	u64 numAlignments_ {};
+	u64 numMemoHits_ {};
+};
+
+} // namespace vil